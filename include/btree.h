@@ -7,6 +7,8 @@
 typedef enum {
     NODE_INTERNAL,
     NODE_LEAF,
+    NODE_INDEX_INTERNAL,
+    NODE_INDEX_LEAF,
 } NodeType;
 
 /*
@@ -16,10 +18,24 @@ static const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
 static const uint32_t NODE_TYPE_OFFSET = 0;
 static const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 static const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
-static const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-static const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-static const uint8_t COMMON_NODE_HEADER_SIZE =
-    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+static const uint32_t FENCE_FLAGS_SIZE = sizeof(uint8_t);
+static const uint32_t FENCE_FLAGS_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+static const uint32_t LOW_FENCE_SIZE = sizeof(Key);
+static const uint32_t LOW_FENCE_OFFSET = FENCE_FLAGS_OFFSET + FENCE_FLAGS_SIZE;
+static const uint32_t HIGH_FENCE_SIZE = sizeof(Key);
+static const uint32_t HIGH_FENCE_OFFSET = LOW_FENCE_OFFSET + LOW_FENCE_SIZE;
+static const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE +
+                                               FENCE_FLAGS_SIZE +
+                                               LOW_FENCE_SIZE + HIGH_FENCE_SIZE;
+
+/*
+ * Fence keys bound the keys a node may hold: greater than the low fence and
+ * at most the high fence. They are the keys on either side of the node in
+ * its parent, so the leftmost nodes have no low fence and the rightmost no
+ * high fence.
+ */
+#define NODE_HAS_LOW_FENCE 0x1
+#define NODE_HAS_HIGH_FENCE 0x2
 
 /*
  * Internal Node Header Layout
@@ -29,19 +45,28 @@ static const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 static const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
 static const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
     INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+static const uint32_t INTERNAL_NODE_MAX_KEYS_SIZE = sizeof(uint32_t);
+static const uint32_t INTERNAL_NODE_MAX_KEYS_OFFSET =
+    INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
 static const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
                                            INTERNAL_NODE_NUM_KEYS_SIZE +
-                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;
+                                           INTERNAL_NODE_RIGHT_CHILD_SIZE +
+                                           INTERNAL_NODE_MAX_KEYS_SIZE;
 
 /*
- * Internal Node Body Layout
+ * Internal Node Body Layout: the keys in one array after the header, then
+ * the child pointers in another, then the number of rows under each child,
+ * the right child's last. Each array has room for the node's max keys, so
+ * it starts at a fixed place. Keeping the keys together lets a search scan
+ * them without touching the rest. The max keys is stored in the header
+ * since it depends on the page size; see node_layout.
  */
-static const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+static const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(Key);
 static const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
-static const uint32_t INTERNAL_NODE_CELL_SIZE =
-    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-/* Keep this small for testing */
-static const uint32_t INTERNAL_NODE_MAX_KEYS = 3;
+static const uint32_t INTERNAL_NODE_COUNT_SIZE = sizeof(RowCount);
+static const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE +
+                                                INTERNAL_NODE_KEY_SIZE +
+                                                INTERNAL_NODE_COUNT_SIZE;
 
 /*
  * Leaf Node Header Layout
@@ -51,55 +76,88 @@ static const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 static const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 static const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
     LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+static const uint32_t LEAF_NODE_PREV_LEAF_SIZE = sizeof(uint32_t);
+static const uint32_t LEAF_NODE_PREV_LEAF_OFFSET =
+    LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+static const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint32_t);
+static const uint32_t LEAF_NODE_CONTENT_START_OFFSET =
+    LEAF_NODE_PREV_LEAF_OFFSET + LEAF_NODE_PREV_LEAF_SIZE;
 static const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
                                        LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+                                       LEAF_NODE_NEXT_LEAF_SIZE +
+                                       LEAF_NODE_PREV_LEAF_SIZE +
+                                       LEAF_NODE_CONTENT_START_SIZE;
 
 /*
- * Leaf Node Body Layout
+ * Leaf Node Body Layout: a slotted page. The directory grows up from the
+ * header: the keys of the cells in order, then the cell offsets in the same
+ * order. The cells, each a serialized row of its own length, grow down from
+ * the end of the page. The free space is the gap between them, from the
+ * directory to the content start. The keys are kept apart from the cells
+ * so a search reads one short array; each row still starts with its id.
  */
-static const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-static const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-static const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-static const uint32_t LEAF_NODE_VALUE_OFFSET =
-    LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-static const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-static const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-static const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-static const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-static const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+static const uint32_t LEAF_NODE_KEY_SIZE = sizeof(Key);
+static const uint32_t LEAF_NODE_OFFSET_SIZE = sizeof(uint16_t);
+/* Directory bytes per cell */
+static const uint32_t LEAF_NODE_SLOT_SIZE =
+    LEAF_NODE_KEY_SIZE + LEAF_NODE_OFFSET_SIZE;
 
 // accessing leaf node fields
 uint32_t *leaf_node_num_cells(void *node);
 void *leaf_node_cell(void *node, uint32_t cell_num);
-uint32_t *leaf_node_key(void *node, uint32_t cell_num);
+Key *leaf_node_key(void *node, uint32_t cell_num);
 void *leaf_node_value(void *node, uint32_t cell_num);
+uint32_t *leaf_node_content_start(void *node);
+uint16_t *leaf_node_slot(void *node, uint32_t cell_num);
+uint32_t leaf_node_cell_size(void *node, uint32_t cell_num);
+uint32_t leaf_node_free_space(void *node);
+void *leaf_node_insert_cell(void *node,
+                            uint32_t cell_num,
+                            Key key,
+                            uint32_t size);
+void leaf_node_remove_first_cells(void *node,
+                                  uint32_t page_size,
+                                  uint32_t num_removed);
 NodeType get_node_type(void *node);
 void set_node_type(void *node, NodeType type);
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key);
+Cursor *leaf_node_find(Table *table, uint32_t page_num, Key key);
 uint32_t *leaf_node_next_leaf(void *node);
-void initialize_leaf_node(void *node);
-void initialize_internal_node(void *node);
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value);
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value);
-void print_constants(void);
+uint32_t *leaf_node_prev_leaf(void *node);
+void initialize_leaf_node(void *node, uint32_t page_size);
+void initialize_internal_node(void *node, uint32_t page_size);
+void leaf_node_insert(Cursor *cursor, Row *value);
+void leaf_node_split_and_insert(Cursor *cursor, Row *value);
+NodeLayout node_layout(uint32_t page_size);
+void print_constants(Table *table);
 void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level);
-void create_new_root(Table *table, uint32_t right_child_page_num);
+void create_new_root(Table *table, Key left_child_max_key,
+                     uint32_t right_child_page_num);
 uint32_t *internal_node_num_keys(void *node);
 uint32_t *internal_node_right_child(void *node);
-uint32_t *internal_node_cell(void *node, uint32_t cell_num);
+uint32_t *internal_node_max_keys(void *node);
+uint32_t *internal_node_child_slot(void *node, uint32_t child_num);
+RowCount *internal_node_count(void *node, uint32_t child_num);
+void set_internal_node_count(void *node, uint32_t child_num, uint64_t count);
+uint64_t node_row_count(Pager *pager, uint32_t page_num);
+uint32_t internal_node_find_child(void *node, Key key);
 uint32_t *internal_node_child(void *node, uint32_t child_num);
-uint32_t *internal_node_key(void *node, uint32_t key_num);
-uint32_t get_node_max_key(Pager *pager, void *node);
+Key *internal_node_key(void *node, uint32_t key_num);
+uint8_t *node_fence_flags(void *node);
+Key *node_low_fence(void *node);
+Key *node_high_fence(void *node);
+bool node_fences_contain(void *node, Key key);
+void split_node_fences(void *left, void *right, Key separator);
+uint32_t key_array_rank(const Key *keys, uint32_t num_keys, Key key);
 bool is_node_root(void *node);
 void set_node_root(void *node, bool is_root);
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key);
-uint32_t *node_parent(void *node);
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key);
+Cursor *internal_node_find(Table *table,
+                           uint32_t page_num,
+                           uint64_t version,
+                           Key key);
 void internal_node_insert(Table *table,
-                          uint32_t parent_page_num,
-                          uint32_t child_page_num);
+                          Cursor *cursor,
+                          uint32_t level,
+                          Key left_child_max_key,
+                          uint32_t right_child_page_num);
 
 #endif // !_BTREE_H
@@ -6,8 +6,18 @@
 
 // cursor functions
 Cursor *table_start(Table *table);
-Cursor *table_find(Table *table, uint32_t key);
+Cursor *table_seek(Table *table, Key key);
+Cursor *table_seek_back(Table *table, Key key);
+Cursor *table_seek_position(Table *table, uint64_t position);
+uint64_t table_rank(Table *table, Key key);
+uint64_t table_row_count(Table *table);
+Cursor *table_find(Table *table, Key key);
+Cursor *table_find_insert(Table *table, Key key);
+Cursor *table_find_row(Table *table, Key key);
+Cursor *table_find_append(Table *table, Key key);
 void *cursor_value(Cursor *cursor);
 void cursor_advance(Cursor *cursor);
+void cursor_retreat(Cursor *cursor);
+void cursor_close(Cursor *cursor);
 
 #endif // !_CURSOR_H
@@ -9,11 +9,78 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <inttypes.h>
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
-#define TABLE_MAX_PAGES 400
+#define PAGER_DEFAULT_PAGE_SIZE 4096
+#define PAGER_MIN_PAGE_SIZE 4096
+#define PAGER_MAX_PAGE_SIZE 65536
+#define PAGER_DEFAULT_CACHE_PAGES 400
+#define PAGER_MIN_CACHE_PAGES 16
+#define PAGER_DEFAULT_MMAP_SIZE (1ULL << 32)
+#define PAGER_MMAP_GROW_PAGES 64
+#define PAGER_DEFAULT_FLUSH_RATE 1000
+#define PAGER_FLUSH_TICK_USEC 10000
+#define PAGER_FLUSH_BATCH_PAGES 64
+#define PAGER_CLEAN_SEARCH_FRAMES 16
+#define WAL_DEFAULT_GROUP_COMMITS 32
+#define WAL_GROUP_COMMIT_USEC 10000
+#define WAL_CHECKPOINT_FRAMES 1000
 #define INVALID_PAGE_NUM UINT32_MAX
+#define BTREE_MAX_DEPTH 16
+#define LOAD_DEFAULT_FILL_PERCENT 90
+#define LOAD_MIN_FILL_PERCENT 10
+#define HASH_INDEX_MIN_SLOTS 1024
+#define PAGER_PAGE_TABLE_STRIPES 64
+#define PAGER_LATCH_BUCKETS 256
+#define PAGER_VERSION_SLOTS 4096
+#define PAGER_VERSION_CHANGES_MASK 0xffffffffULL
+#define PAGER_SHADOW_BUCKETS 256
+#define SCAN_PARTS_PER_THREAD 4
+#define POOL_MAX_THREADS 64
+#define POOL_DEQUE_SIZE 256
+
+/*
+ * Row keys are 32 bits wide unless the tree is built with KEY_BITS=64. The
+ * width is part of the cell format, so a database only opens in a build with
+ * the same key width. The row counts internal nodes keep for their children
+ * are as wide as keys: a child never holds every key, so its count fits.
+ */
+#ifndef KEY_BITS
+#define KEY_BITS 32
+#endif
+#if KEY_BITS == 64
+typedef uint64_t Key;
+typedef uint64_t RowCount;
+#define KEY_MAX UINT64_MAX
+#define KEY_FORMAT PRIu64
+#elif KEY_BITS == 32
+typedef uint32_t Key;
+typedef uint32_t RowCount;
+#define KEY_MAX UINT32_MAX
+#define KEY_FORMAT PRIu32
+#else
+#error "KEY_BITS must be 32 or 64"
+#endif
+
+/*
+ * Key searches compare the last few keys of a node with SIMD when the build
+ * targets it (SSE2 for 32-bit keys, SSE4.2 for 64-bit keys) and with a plain
+ * loop otherwise.
+ */
+#if defined(__SSE2__) && KEY_BITS == 32
+#include <emmintrin.h>
+#elif defined(__SSE4_2__) && KEY_BITS == 64
+#include <nmmintrin.h>
+#endif
+#define KEY_SEARCH_WINDOW 16
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0)->Attribute)
 
 typedef struct {
@@ -23,21 +90,294 @@ typedef struct {
 } InputBuffer;
 
 typedef struct {
-    uint32_t id;
+    Key id;
     char username[COLUMN_USERNAME_SIZE + 1];
     char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+typedef struct {
+    uint32_t page_size;
+    uint32_t cache_pages;
+    bool use_mmap;
+    uint64_t mmap_size;
+    bool use_wal;
+    uint32_t wal_group_commits;
+    /* Return from a commit before its log records are synced */
+    bool async_commit;
+    uint32_t flush_rate;
+    bool hash_index;
+    uint32_t threads;
+    /* Let other threads read between db_read_begin and db_read_end */
+    bool concurrent_readers;
+} DbOptions;
+
+/*
+ * A frame is one page-sized slot of the buffer pool. A pinned frame is in use
+ * by a caller and is never chosen as an eviction victim. A dirty frame differs
+ * from the copy on disk and must be written back before it is reused.
+ */
+typedef struct {
+    void *data;
+    uint32_t page_num;
+    uint32_t pin_count;
+    bool referenced;
+    bool dirty;
+    bool uncommitted;
+    /*
+     * writing: the flusher has copied the page and its write is in flight.
+     * checkpoint: the page has an image in the retired log that the running
+     * checkpoint still has to write. commit_seq: the log commit holding the
+     * latest change, which must be synced before the page may be written.
+     * loading: the page is being read into the frame without the lock.
+     */
+    bool writing;
+    bool checkpoint;
+    bool loading;
+    uint64_t commit_seq;
+} Frame;
+
+typedef struct {
+    uint32_t page_num;
+    uint32_t frame_num;
+} PageTableEntry;
+
+/*
+ * The part of the page table for the pages that hash to one stripe, with a
+ * lock of its own, so threads pinning different pages rarely meet.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    PageTableEntry *entries;
+    uint32_t mask;
+    uint32_t num_entries;
+} PageTableStripe;
+
+/*
+ * Write-ahead log kept next to the database file. Each committed statement
+ * appends an image of every page it modified; the log is synced once per group
+ * of commits and folded back into the database file by a checkpoint.
+ */
+typedef struct {
+    int file_descriptor;
+    char *path;
+    char *old_path;
+    uint32_t page_size;
+    uint64_t file_length;
+    uint32_t salt;
+    uint64_t checksum;
+    uint32_t num_frames;
+    uint64_t commit_seq;
+    uint64_t synced_seq;
+    uint32_t group_commits;
+    uint64_t first_pending_usec;
+} Wal;
+
+/*
+ * The columns that can have a secondary index.
+ */
+typedef enum {
+    INDEX_USERNAME,
+    INDEX_EMAIL,
+    NUM_INDEX_COLUMNS,
+} IndexColumn;
+
+/*
+ * Metadata kept in the header page. pager_open reads it once and
+ * pager_commit writes it back with any statement that changed it.
+ */
+typedef struct {
+    uint32_t root_page_num;
+    uint32_t freelist_head;
+    uint32_t freelist_count;
+    uint64_t row_count;
+    uint32_t index_root_page_nums[NUM_INDEX_COLUMNS];
+} DbHeader;
+
+/*
+ * A reader/writer latch on one page, held while a thread reads or changes
+ * the page. A latch only exists while some thread holds or waits for it;
+ * the pager finds it by page number in a small chained hash table.
+ */
+typedef struct Latch {
+    uint32_t page_num;
+    uint32_t users;
+    pthread_rwlock_t rwlock;
+    struct Latch *next;
+} Latch;
+
+/* The latches of the pages that hash to one bucket, and spares for them */
+typedef struct {
+    pthread_mutex_t lock;
+    Latch *latches;
+    Latch *free;
+} LatchBucket;
+
+typedef struct ShadowPage ShadowPage;
+
+/* The shadow pages of the pages that hash to one bucket */
+typedef struct {
+    pthread_mutex_t lock;
+    ShadowPage *pages;
+} ShadowBucket;
+
+/*
+ * A reader's view of the tree as of commit seq, open on one thread.
+ */
+typedef struct Snapshot {
+    uint64_t seq;
+    struct Snapshot *next;
+} Snapshot;
+
 typedef struct {
     int file_descriptor;
-    uint32_t file_length;
+    uint64_t file_length;
     uint32_t num_pages;
-    void *pages[TABLE_MAX_PAGES];
+    uint32_t page_size;
+    DbHeader header;
+    /*
+     * The first cache_pages frames share frame_data. A statement that
+     * modifies more pages than that gets extra frames, released at commit.
+     */
+    uint32_t cache_pages;
+    uint32_t num_frames;
+    uint32_t frames_capacity;
+    Frame *frames;
+    void *frame_data;
+    uint32_t clock_hand;
+    PageTableStripe page_table[PAGER_PAGE_TABLE_STRIPES];
+    /*
+     * In mmap mode the whole file lives in one shared mapping reserved at
+     * mmap_size bytes, so page pointers stay valid as the file grows and the
+     * frames above are unused.
+     */
+    void *map;
+    uint64_t map_size;
+    uint8_t *dirty_map;
+    /*
+     * Pages modified by the statement in progress. They are logged when the
+     * statement commits and cannot be evicted before that.
+     */
+    Wal *wal;
+    uint32_t *txn_pages;
+    uint32_t num_txn_pages;
+    /*
+     * The flusher thread syncs the log, writes dirty pages ahead of the CLOCK
+     * hand at flush_rate pages per second and runs checkpoints. It runs
+     * whenever there is a log, only syncing it at a flush rate of 0. lock
+     * guards every field above, except that a resident page is pinned and
+     * unpinned under its page table stripe's lock alone, with atomic pin
+     * counts; page contents are only touched by the flusher while the frame
+     * is unpinned. page_loaded is signalled when a page read without the
+     * lock lands.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t page_loaded;
+    pthread_cond_t flusher_wake;
+    pthread_cond_t write_done;
+    pthread_t flusher;
+    bool flusher_running;
+    bool flusher_stop;
+    /*
+     * Unless commits are asynchronous, a statement waits on wal_synced until
+     * the flusher has synced its commit. sync_waiters counts the waiting
+     * statements, which the flusher syncs for right away.
+     */
+    bool async_commit;
+    pthread_cond_t wal_synced;
+    uint32_t sync_waiters;
+    bool flush_in_progress;
+    uint32_t flush_rate;
+    bool checkpointing;
+    uint32_t checkpoint_pages;
+    /*
+     * A thread that needs a frame while other threads hold every pin waits
+     * on frame_free. pinning_threads counts the threads holding pins and
+     * blocked_pinners those of them waiting for a frame or a latch, whose
+     * pins will not come free on their own.
+     */
+    pthread_cond_t frame_free;
+    uint32_t frame_waiters;
+    uint32_t pinning_threads;
+    uint32_t blocked_pinners;
+    /*
+     * Page latches are only taken while latching is on, which is when the
+     * database was opened for concurrent readers. A bucket's lock guards
+     * its chain, not the latches in it.
+     */
+    bool latching;
+    LatchBucket latch_buckets[PAGER_LATCH_BUCKETS];
+    /*
+     * Version counters for reading internal nodes without latches, shared
+     * by the pages that hash to the same slot. The low 32 bits count the
+     * changes to its pages in progress, which may nest, and the high 32
+     * bits the changes finished.
+     */
+    uint64_t page_versions[PAGER_VERSION_SLOTS];
+    /*
+     * Shadow pages for snapshot reads, saved while latching is on.
+     * snapshot_seq counts commits. shadow_lock guards it and the list of
+     * open snapshots; each bucket's lock guards its shadow pages.
+     */
+    uint64_t snapshot_seq;
+    uint32_t num_shadow_pages;
+    pthread_mutex_t shadow_lock;
+    ShadowBucket shadow_buckets[PAGER_SHADOW_BUCKETS];
+    Snapshot *snapshots;
 } Pager;
 
+/*
+ * Node limits that depend on the page size of the open database.
+ */
+typedef struct {
+    uint32_t leaf_node_space_for_cells;
+    uint32_t internal_node_max_keys;
+} NodeLayout;
+
+/*
+ * In-memory map from each id to the leaf holding its row, kept as an open
+ * addressing table with linear probing. Slots are small and stored inline,
+ * so a probe usually reads one cache line. Page 0 is the header, never a
+ * leaf, so it marks an empty slot. Only the page is kept: an insert shifts
+ * the cells of a leaf, while the row stays in the same leaf until a split.
+ */
+typedef struct {
+    Key key;
+    uint32_t page_num;
+} HashSlot;
+
+typedef struct {
+    HashSlot *slots;
+    uint64_t num_slots;
+    uint64_t num_keys;
+    uint32_t shift;
+    pthread_rwlock_t lock;
+} HashIndex;
+
+typedef struct TaskPool TaskPool;
+
 typedef struct {
     Pager *pager;
     uint32_t root_page_num;
+    NodeLayout layout;
+    /* NULL unless the database was opened with a hash index */
+    HashIndex *hash_index;
+    /* The worker threads that run the parts of a query */
+    TaskPool *pool;
+    /*
+     * Reader threads and the one writer share the tree under page latches.
+     * Operations that rewrite pages without latching them, like vacuum,
+     * hold lock exclusively; every reader operation holds it shared.
+     */
+    pthread_rwlock_t lock;
+    /*
+     * The last leaf a lookup found to be the rightmost one and the internal
+     * nodes above it, so appends can skip the search. Only a hint: the leaf
+     * is checked before use, and the hint is reset when the internal nodes
+     * change or pages are moved or freed.
+     */
+    uint32_t rightmost_leaf_page_num;
+    uint32_t rightmost_depth;
+    uint32_t rightmost_path_page_nums[BTREE_MAX_DEPTH];
 } Table;
 
 typedef struct {
@@ -45,16 +385,28 @@ typedef struct {
     uint32_t page_num;
     uint32_t cell_num;
     bool end_of_table;
+    /*
+     * The internal nodes above the leaf, root first, and the child followed
+     * in each. Set when the cursor is positioned by a lookup; moving to
+     * another leaf does not update it.
+     */
+    uint32_t depth;
+    uint32_t path_page_nums[BTREE_MAX_DEPTH];
+    uint32_t path_child_nums[BTREE_MAX_DEPTH];
+    /* Whether the cursor holds a shared latch on its leaf */
+    bool latched;
 } Cursor;
 
+/*
+ * Serialized Row Layout: the id, then each string as a one byte length
+ * followed by that many bytes. ROW_SIZE is the size of the longest row.
+ */
 static const uint32_t ID_SIZE = size_of_attribute(Row, id);
-static const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-static const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
 static const uint32_t ID_OFFSET = 0;
-static const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-static const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-static const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
-static const uint32_t PAGE_SIZE = 4096;
+static const uint32_t FIELD_LENGTH_SIZE = sizeof(uint8_t);
+static const uint32_t ROW_SIZE = ID_SIZE + FIELD_LENGTH_SIZE +
+                                 COLUMN_USERNAME_SIZE + FIELD_LENGTH_SIZE +
+                                 COLUMN_EMAIL_SIZE;
 
 // buffer read functions
 InputBuffer *new_input_buffer(void);
@@ -62,12 +414,22 @@ void read_input(InputBuffer *input_buffer);
 void close_input_buffer(InputBuffer *input_buffer);
 
 // database file reader
-Table *db_open(const char *filename);
+DbOptions db_default_options(void);
+Table *db_open(const char *filename, const DbOptions *options);
 void db_close(Table *table);
+void db_read_begin(Table *table, Snapshot *snapshot);
+void db_read_end(Table *table, Snapshot *snapshot);
+
+// clock and checksum helpers
+uint64_t now_usec(void);
+uint64_t fletcher_checksum(uint64_t seed, const void *data, uint32_t length);
 
 // database row functions
+void print_header(Table *table);
 void print_row(Row *row);
-void serialize_row(Row *source, void *destination);
+uint32_t serialized_row_size(Row *source);
+uint32_t serialize_row(Row *source, void *destination);
 void deserialize_row(void *source, Row *destination);
+uint32_t row_record_size(void *source);
 
 #endif // !_DB_H
@@ -0,0 +1,14 @@
+#ifndef _HASH_INDEX_H
+#define _HASH_INDEX_H
+
+#include "db.h"
+#include "btree.h"
+
+// hash index functions
+void hash_index_build(Table *table);
+void hash_index_free(HashIndex *index);
+uint32_t hash_index_get(HashIndex *index, Key key);
+void hash_index_put(HashIndex *index, Key key, uint32_t page_num);
+void hash_index_put_leaf(HashIndex *index, void *node, uint32_t page_num);
+
+#endif // !_HASH_INDEX_H
@@ -0,0 +1,35 @@
+#ifndef _INDEX_H
+#define _INDEX_H
+
+#include "db.h"
+#include "btree.h"
+#include "cursor.h"
+
+/*
+ * Index Node Layout: index nodes are slotted pages with the leaf node
+ * layout, each cell an entry of the index: the column value as a one byte
+ * length and its bytes, then the id of the row. The id makes entries unique
+ * when values repeat. The key array holds the first bytes of each value,
+ * big-endian, so it sorts like the values and a search narrows to the
+ * entries sharing a prefix before comparing whole values. In an internal
+ * index node each cell starts with a child page, and its entry is the
+ * largest one under that child; the child after the last cell is kept in
+ * the next leaf field. Index leaves are linked both ways like table leaves.
+ */
+static const uint32_t INDEX_NODE_CHILD_SIZE = sizeof(uint32_t);
+
+// index functions
+const char *index_column_name(IndexColumn column);
+bool index_column_from_name(const char *name, IndexColumn *column);
+const char *row_column_value(Row *row, IndexColumn column);
+bool index_exists(Table *table, IndexColumn column);
+void index_create(Table *table, IndexColumn column);
+void index_drop(Table *table, IndexColumn column);
+void index_insert(Table *table, IndexColumn column, const char *value, Key id);
+void index_insert_row(Table *table, Row *row);
+Key *index_lookup(Table *table,
+                  IndexColumn column,
+                  const char *value,
+                  uint64_t *num_ids);
+
+#endif // !_INDEX_H
@@ -0,0 +1,12 @@
+#ifndef _LOAD_H
+#define _LOAD_H
+
+#include "db.h"
+#include "btree.h"
+#include "index.h"
+#include "hash_index.h"
+
+// bulk load functions
+void table_bulk_load(Table *table, const char *filename, uint32_t fill_percent);
+
+#endif // !_LOAD_H
@@ -2,11 +2,61 @@
 #define _PAGER_H
 
 #include "db.h"
+#include "wal.h"
+
+#define DB_HEADER_MAGIC "db format\0\0\0\0\0\0\0"
+#define DB_FORMAT_VERSION 10
+
+/*
+ * Header Page Layout: page 0 of every database file starts with a magic
+ * string and a checksummed metadata block. Tree pages start at page 1.
+ * DB_FORMAT_VERSION changes with every change to the on-disk format.
+ */
+static const uint32_t DB_HEADER_PAGE = 0;
+static const uint32_t DB_HEADER_MAGIC_OFFSET = 0;
+static const uint32_t DB_HEADER_MAGIC_SIZE = 16;
+static const uint32_t DB_HEADER_VERSION_OFFSET = 16;
+static const uint32_t DB_HEADER_PAGE_SIZE_OFFSET = 20;
+static const uint32_t DB_HEADER_NUM_PAGES_OFFSET = 24;
+static const uint32_t DB_HEADER_ROOT_PAGE_OFFSET = 28;
+static const uint32_t DB_HEADER_FREELIST_HEAD_OFFSET = 32;
+static const uint32_t DB_HEADER_FREELIST_COUNT_OFFSET = 36;
+static const uint32_t DB_HEADER_ROW_COUNT_OFFSET = 40;
+static const uint32_t DB_HEADER_KEY_SIZE_OFFSET = 48;
+/* One root page per index column, 0 for none */
+static const uint32_t DB_HEADER_INDEX_ROOTS_OFFSET = 52;
+static const uint32_t DB_HEADER_CHECKSUM_OFFSET = 64;
+static const uint32_t DB_HEADER_SIZE = 72;
+
+/*
+ * Freelist Trunk Page Layout: free pages are chained through trunk pages.
+ * Each trunk holds the next trunk and the numbers of as many further free
+ * pages as fit in the rest of the page, so freeing or reusing a page touches
+ * at most two pages.
+ */
+static const uint32_t FREELIST_TRUNK_NEXT_OFFSET = 0;
+static const uint32_t FREELIST_TRUNK_NUM_LEAVES_OFFSET = 4;
+static const uint32_t FREELIST_TRUNK_HEADER_SIZE = 8;
 
 // pager functions
 void *get_page(Pager *pager, uint32_t page_num);
+void unpin_page(Pager *pager, uint32_t page_num);
+void mark_page_dirty(Pager *pager, uint32_t page_num);
+void latch_page(Pager *pager, uint32_t page_num, bool exclusive);
+void unlatch_page(Pager *pager, uint32_t page_num);
+uint64_t page_version(Pager *pager, uint32_t page_num);
+bool page_version_valid(Pager *pager, uint32_t page_num, uint64_t version);
+void page_change_begin(Pager *pager, uint32_t page_num);
+void page_change_end(Pager *pager, uint32_t page_num);
 uint32_t get_unused_page_num(Pager *pager);
-Pager *pager_open(const char *filename);
+void free_page(Pager *pager, uint32_t page_num);
+uint32_t *pager_drain_freelist(Pager *pager, uint32_t *num_free);
+void pager_truncate(Pager *pager, uint32_t num_pages);
+Pager *pager_open(const char *filename, const DbOptions *options);
 void pager_flush(Pager *pager, uint32_t page_num);
+void pager_flush_all(Pager *pager);
+void pager_commit(Pager *pager);
+void pager_checkpoint(Pager *pager);
+void pager_close(Pager *pager);
 
 #endif // !_PAGER_H
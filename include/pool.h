@@ -0,0 +1,25 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include "db.h"
+
+typedef void (*TaskFunction)(void *arg);
+
+/*
+ * Tasks submitted together, to wait for as one. Start it zeroed.
+ */
+typedef struct {
+    uint32_t pending;
+} TaskGroup;
+
+// task pool functions
+TaskPool *pool_create(uint32_t num_workers);
+void pool_destroy(TaskPool *pool);
+uint32_t pool_num_threads(TaskPool *pool);
+void pool_submit(TaskPool *pool,
+                 TaskGroup *group,
+                 TaskFunction function,
+                 void *arg);
+void pool_wait(TaskPool *pool, TaskGroup *group);
+
+#endif // !_POOL_H
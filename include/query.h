@@ -4,24 +4,45 @@
 #include "db.h"
 #include "btree.h"
 #include "cursor.h"
+#include "index.h"
 
 typedef enum {
     EXECUTE_SUCCESS,
     EXECUTE_DUPLICATE_KEY,
+    EXECUTE_INDEX_EXISTS,
 } ExecuteResult;
 
 typedef enum {
     STATEMENT_INSERT,
     STATEMENT_SELECT,
+    STATEMENT_CREATE_INDEX,
 } StatementType;
 
 typedef struct {
     StatementType type;
     Row row_to_insert;
+    /*
+     * The ids a select returns, inclusive, in which order, how many after
+     * skipping offset, or just how many there are
+     */
+    Key min_id;
+    Key max_id;
+    bool descending;
+    uint64_t limit;
+    uint64_t offset;
+    bool count;
+    /*
+     * The column of create index, or of a select of the rows where it
+     * holds value
+     */
+    IndexColumn column;
+    bool by_value;
+    char value[COLUMN_EMAIL_SIZE + 1];
 } Statement;
 
 ExecuteResult execute_insert(Statement *statement, Table *table);
 ExecuteResult execute_select(Statement *statement, Table *table);
+ExecuteResult execute_create_index(Statement *statement, Table *table);
 ExecuteResult execute_statement(Statement *statement, Table *table);
 
 #endif // !_QUERY_H
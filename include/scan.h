@@ -0,0 +1,19 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include "db.h"
+#include "btree.h"
+#include "cursor.h"
+#include "index.h"
+#include "pool.h"
+#include "snapshot.h"
+
+// parallel scan functions
+Key *table_scan_ids(Table *table,
+                    Key min_id,
+                    Key max_id,
+                    IndexColumn column,
+                    const char *value,
+                    uint64_t *num_ids);
+
+#endif // !_SCAN_H
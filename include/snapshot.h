@@ -0,0 +1,17 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include "db.h"
+
+// snapshot functions
+void snapshot_begin(Pager *pager, Snapshot *snapshot);
+void snapshot_end(Pager *pager, Snapshot *snapshot);
+Snapshot *snapshot_current(void);
+Snapshot *snapshot_install(Snapshot *snapshot);
+void *snapshot_page(Pager *pager, uint32_t page_num);
+void shadow_page_save(Pager *pager, uint32_t page_num, void *page);
+void snapshot_commit(Pager *pager);
+void shadow_pages_collect(Pager *pager);
+void shadow_pages_free(Pager *pager);
+
+#endif // !_SNAPSHOT_H
@@ -0,0 +1,12 @@
+#ifndef _VACUUM_H
+#define _VACUUM_H
+
+#include "db.h"
+#include "btree.h"
+#include "index.h"
+#include "hash_index.h"
+
+// vacuum functions
+void table_vacuum(Table *table);
+
+#endif // !_VACUUM_H
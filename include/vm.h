@@ -3,6 +3,8 @@
 
 #include "db.h"
 #include "query.h"
+#include "vacuum.h"
+#include "load.h"
 
 typedef enum {
     META_COMMAND_SUCCESS,
@@ -12,6 +14,7 @@ typedef enum {
 typedef enum {
     PREPARE_SUCCESS,
     PREPARE_NEGATIVE_ID,
+    PREPARE_ID_TOO_LARGE,
     PREPARE_STRING_TOO_LONG,
     PREPARE_SYNTAX_ERROR,
     PREPARE_UNRECOGNIZED_STATEMENT,
@@ -22,5 +25,11 @@ meta_command_result do_meta_command(InputBuffer *input_buffer, Table *table);
 prepare_result prepare_statement(InputBuffer *input_buffer,
                                  Statement *statement);
 prepare_result prepare_insert(InputBuffer *input_buffer, Statement *statement);
+prepare_result prepare_select(InputBuffer *input_buffer, Statement *statement);
+prepare_result prepare_create_index(InputBuffer *input_buffer,
+                                    Statement *statement);
+prepare_result parse_id(char *id_string, Key *id);
+prepare_result parse_row(char *id_string, char *username, char *email,
+                         Row *row);
 
 #endif // !_VM_H
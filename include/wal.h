@@ -0,0 +1,47 @@
+#ifndef _WAL_H
+#define _WAL_H
+
+#include "db.h"
+
+#define WAL_MAGIC 0x4c415754
+#define WAL_VERSION 1
+
+/*
+ * WAL Header Layout
+ */
+static const uint32_t WAL_MAGIC_OFFSET = 0;
+static const uint32_t WAL_VERSION_OFFSET = 4;
+static const uint32_t WAL_PAGE_SIZE_OFFSET = 8;
+static const uint32_t WAL_SALT_OFFSET = 12;
+static const uint32_t WAL_HEADER_SIZE = 32;
+
+/*
+ * WAL Frame Layout: a frame header followed by a full page image. A commit
+ * frame closes a statement and records the database size in pages; the
+ * checksum chains through every earlier frame since the header.
+ */
+static const uint32_t WAL_FRAME_PAGE_NUM_OFFSET = 0;
+static const uint32_t WAL_FRAME_DB_PAGES_OFFSET = 4;
+static const uint32_t WAL_FRAME_SALT_OFFSET = 8;
+static const uint32_t WAL_FRAME_CHECKSUM_OFFSET = 16;
+static const uint32_t WAL_FRAME_HEADER_SIZE = 24;
+
+// write-ahead log functions
+void wal_recover(const char *db_filename, int db_fd);
+Wal *wal_open(const char *db_filename,
+              uint32_t group_commits,
+              uint32_t page_size);
+uint64_t wal_commit(Wal *wal,
+                    uint32_t num_pages,
+                    const uint32_t *page_nums,
+                    void *const *pages,
+                    uint32_t db_num_pages);
+bool wal_sync_due(Wal *wal);
+void wal_sync(Wal *wal);
+bool wal_needs_checkpoint(Wal *wal);
+void wal_reset(Wal *wal);
+void wal_retire(Wal *wal);
+void wal_retire_done(Wal *wal);
+void wal_close(Wal *wal);
+
+#endif // !_WAL_H
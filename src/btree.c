@@ -1,4 +1,5 @@
 #include "btree.h"
+#include "hash_index.h"
 
 NodeType get_node_type(void *node) {
     uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
@@ -20,8 +21,41 @@ void set_node_root(void *node, bool is_root) {
     *((uint8_t *)(node + IS_ROOT_OFFSET)) = value;
 }
 
-uint32_t *node_parent(void *node) {
-    return node + PARENT_POINTER_OFFSET;
+uint8_t *node_fence_flags(void *node) {
+    return node + FENCE_FLAGS_OFFSET;
+}
+
+Key *node_low_fence(void *node) {
+    return node + LOW_FENCE_OFFSET;
+}
+
+Key *node_high_fence(void *node) {
+    return node + HIGH_FENCE_OFFSET;
+}
+
+bool node_fences_contain(void *node, Key key) {
+    uint8_t flags = *node_fence_flags(node);
+    if ((flags & NODE_HAS_LOW_FENCE) && key <= *node_low_fence(node)) {
+        return false;
+    }
+    if ((flags & NODE_HAS_HIGH_FENCE) && key > *node_high_fence(node)) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Divide the key range of a node that split between it and its new right
+ * sibling. The right node takes over the old high fence.
+ */
+void split_node_fences(void *left, void *right, Key separator) {
+    uint8_t left_flags = *node_fence_flags(left);
+    *node_high_fence(right) = *node_high_fence(left);
+    *node_low_fence(right) = separator;
+    *node_fence_flags(right) =
+        (left_flags & NODE_HAS_HIGH_FENCE) | NODE_HAS_LOW_FENCE;
+    *node_high_fence(left) = separator;
+    *node_fence_flags(left) = left_flags | NODE_HAS_HIGH_FENCE;
 }
 
 uint32_t *internal_node_num_keys(void *node) {
@@ -32,9 +66,14 @@ uint32_t *internal_node_right_child(void *node) {
     return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
-uint32_t *internal_node_cell(void *node, uint32_t cell_num) {
+uint32_t *internal_node_max_keys(void *node) {
+    return node + INTERNAL_NODE_MAX_KEYS_OFFSET;
+}
+
+uint32_t *internal_node_child_slot(void *node, uint32_t child_num) {
     return node + INTERNAL_NODE_HEADER_SIZE +
-           cell_num * INTERNAL_NODE_CELL_SIZE;
+           *internal_node_max_keys(node) * INTERNAL_NODE_KEY_SIZE +
+           child_num * INTERNAL_NODE_CHILD_SIZE;
 }
 
 uint32_t *internal_node_child(void *node, uint32_t child_num) {
@@ -53,7 +92,7 @@ uint32_t *internal_node_child(void *node, uint32_t child_num) {
         }
         return right_child;
     } else {
-        uint32_t *child = internal_node_cell(node, child_num);
+        uint32_t *child = internal_node_child_slot(node, child_num);
         if (*child == INVALID_PAGE_NUM) {
             printf("Tried to access child %d of node, but was invalid page\n",
                    child_num);
@@ -63,8 +102,37 @@ uint32_t *internal_node_child(void *node, uint32_t child_num) {
     }
 }
 
-uint32_t *internal_node_key(void *node, uint32_t key_num) {
-    return (void *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+RowCount *internal_node_count(void *node, uint32_t child_num) {
+    uint32_t max_keys = *internal_node_max_keys(node);
+    return node + INTERNAL_NODE_HEADER_SIZE +
+           max_keys * (INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_CHILD_SIZE) +
+           child_num * INTERNAL_NODE_COUNT_SIZE;
+}
+
+void set_internal_node_count(void *node, uint32_t child_num, uint64_t count) {
+    *internal_node_count(node, child_num) = count;
+}
+
+/*
+ * The number of rows under a node: a leaf's cells, or the sum of an internal
+ * node's child counts.
+ */
+uint64_t node_row_count(Pager *pager, uint32_t page_num) {
+    void *node = get_page(pager, page_num);
+    uint64_t count = 0;
+    if (get_node_type(node) == NODE_LEAF) {
+        count = *leaf_node_num_cells(node);
+    } else {
+        for (uint32_t i = 0; i <= *internal_node_num_keys(node); i++) {
+            count += *internal_node_count(node, i);
+        }
+    }
+    unpin_page(pager, page_num);
+    return count;
+}
+
+Key *internal_node_key(void *node, uint32_t key_num) {
+    return node + INTERNAL_NODE_HEADER_SIZE + key_num * INTERNAL_NODE_KEY_SIZE;
 }
 
 uint32_t *leaf_node_num_cells(void *node) {
@@ -75,46 +143,168 @@ uint32_t *leaf_node_next_leaf(void *node) {
     return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
+uint32_t *leaf_node_prev_leaf(void *node) {
+    return node + LEAF_NODE_PREV_LEAF_OFFSET;
+}
+
+uint32_t *leaf_node_content_start(void *node) {
+    return node + LEAF_NODE_CONTENT_START_OFFSET;
+}
+
+uint16_t *leaf_node_slot(void *node, uint32_t cell_num) {
+    return node + LEAF_NODE_HEADER_SIZE +
+           *leaf_node_num_cells(node) * LEAF_NODE_KEY_SIZE +
+           cell_num * LEAF_NODE_OFFSET_SIZE;
+}
+
 void *leaf_node_cell(void *node, uint32_t cell_num) {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+    return node + *leaf_node_slot(node, cell_num);
 }
 
-uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num);
+Key *leaf_node_key(void *node, uint32_t cell_num) {
+    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_KEY_SIZE;
 }
 
 void *leaf_node_value(void *node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    return leaf_node_cell(node, cell_num);
 }
 
-uint32_t get_node_max_key(Pager *pager, void *node) {
-    if (get_node_type(node) == NODE_LEAF) {
-        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+uint32_t leaf_node_cell_size(void *node, uint32_t cell_num) {
+    return row_record_size(leaf_node_cell(node, cell_num));
+}
+
+/*
+ * Bytes left between the directory and the cell content. A new cell needs
+ * its own size plus a key and an offset in the directory.
+ */
+uint32_t leaf_node_free_space(void *node) {
+    return *leaf_node_content_start(node) - LEAF_NODE_HEADER_SIZE -
+           *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE;
+}
+
+/*
+ * Make room for a cell with the given key and size at cell_num: the offset
+ * array moves up past one more key, the keys and offsets after cell_num
+ * shift up by one, and the cell is carved from the bottom of the content
+ * area. The caller checks the space and fills in the cell.
+ */
+void *leaf_node_insert_cell(void *node,
+                            uint32_t cell_num,
+                            Key key,
+                            uint32_t size) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint16_t *old_offsets = leaf_node_slot(node, 0);
+    *leaf_node_num_cells(node) = num_cells + 1;
+    uint16_t *new_offsets = leaf_node_slot(node, 0);
+
+    /* Upper part first: both parts move up */
+    memmove(new_offsets + cell_num + 1,
+            old_offsets + cell_num,
+            (num_cells - cell_num) * LEAF_NODE_OFFSET_SIZE);
+    memmove(new_offsets, old_offsets, cell_num * LEAF_NODE_OFFSET_SIZE);
+    memmove(leaf_node_key(node, cell_num + 1),
+            leaf_node_key(node, cell_num),
+            (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+
+    *leaf_node_content_start(node) -= size;
+    *leaf_node_key(node, cell_num) = key;
+    new_offsets[cell_num] = *leaf_node_content_start(node);
+    return leaf_node_cell(node, cell_num);
+}
+
+/*
+ * Drop the first num_removed cells and pack the rest against the end of the
+ * page again, so the free space stays in one piece.
+ */
+void leaf_node_remove_first_cells(void *node,
+                                  uint32_t page_size,
+                                  uint32_t num_removed) {
+    void *copy = malloc(page_size);
+    memcpy(copy, node, page_size);
+
+    uint32_t num_cells = *leaf_node_num_cells(copy);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_content_start(node) = page_size;
+    for (uint32_t i = num_removed; i < num_cells; i++) {
+        uint32_t size = leaf_node_cell_size(copy, i);
+        memcpy(leaf_node_insert_cell(
+                   node, i - num_removed, *leaf_node_key(copy, i), size),
+               leaf_node_cell(copy, i),
+               size);
     }
-    void *right_child = get_page(pager, *internal_node_right_child(node));
-    return get_node_max_key(pager, right_child);
+    free(copy);
 }
 
-void initialize_leaf_node(void *node) {
+void initialize_leaf_node(void *node, uint32_t page_size) {
     set_node_type(node, NODE_LEAF);
     set_node_root(node, false);
+    *node_fence_flags(node) = 0;
     *leaf_node_num_cells(node) = 0;
     *leaf_node_next_leaf(node) = 0; // 0 represents no sibling
+    *leaf_node_prev_leaf(node) = 0;
+    *leaf_node_content_start(node) = page_size;
 }
 
-void initialize_internal_node(void *node) {
+void initialize_internal_node(void *node, uint32_t page_size) {
     set_node_type(node, NODE_INTERNAL);
     set_node_root(node, false);
+    *node_fence_flags(node) = 0;
     *internal_node_num_keys(node) = 0;
+    *internal_node_max_keys(node) = node_layout(page_size).internal_node_max_keys;
     /*
-  Necessary because the root page number is 0; by not initializing an internal 
-  node's right child to an invalid page number when initializing the node, we may
-  end up with 0 as the node's right child, which makes the node a parent of the root
-  */
+     * An empty node has no right child yet. Leaving the field zeroed would
+     * point it at page 0, the database header, so mark it invalid instead.
+     */
     *internal_node_right_child(node) = INVALID_PAGE_NUM;
 }
 
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
+/*
+ * The number of keys in a sorted array that are less than key, which is the
+ * index of the first key at least key. Halving steps narrow the range with
+ * a conditional move rather than a branch, then the last few keys are all
+ * compared, a vector at a time where the build allows.
+ */
+uint32_t key_array_rank(const Key *keys, uint32_t num_keys, Key key) {
+    const Key *base = keys;
+    uint32_t n = num_keys;
+    while (n > KEY_SEARCH_WINDOW) {
+        uint32_t half = n / 2;
+        base = base[half - 1] < key ? base + half : base;
+        n -= half;
+    }
+
+    uint32_t rank = base - keys;
+    uint32_t i = 0;
+#if defined(__SSE2__) && KEY_BITS == 32
+    /* Flipping the sign bits lets a signed compare order unsigned keys */
+    __m128i bias = _mm_set1_epi32(INT32_MIN);
+    __m128i target = _mm_xor_si128(_mm_set1_epi32((int32_t)key), bias);
+    for (; i + 4 <= n; i += 4) {
+        __m128i chunk = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)(base + i)), bias);
+        __m128i less = _mm_cmplt_epi32(chunk, target);
+        rank += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+    }
+#elif defined(__SSE4_2__) && KEY_BITS == 64
+    __m128i bias = _mm_set1_epi64x(INT64_MIN);
+    __m128i target = _mm_xor_si128(_mm_set1_epi64x((int64_t)key), bias);
+    for (; i + 2 <= n; i += 2) {
+        __m128i chunk = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)(base + i)), bias);
+        __m128i less = _mm_cmpgt_epi64(target, chunk);
+        rank += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(less)));
+    }
+#endif
+    for (; i < n; i++) {
+        rank += base[i] < key;
+    }
+    return rank;
+}
+
+/*
+ * The returned cursor keeps the leaf pinned; release it with cursor_close.
+ */
+Cursor *leaf_node_find(Table *table, uint32_t page_num, Key key) {
     void *node = get_page(table->pager, page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
 
@@ -122,68 +312,148 @@ Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
     cursor->table = table;
     cursor->page_num = page_num;
     cursor->end_of_table = false;
+    cursor->depth = 0;
+    cursor->latched = false;
 
-    // Binary search
-    uint32_t min_index = 0;
-    uint32_t one_past_max_index = num_cells;
-    while (one_past_max_index != min_index) {
-        uint32_t index = (min_index + one_past_max_index) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
-        if (key == key_at_index) {
-            cursor->cell_num = index;
-            return cursor;
-        }
-        if (key < key_at_index) {
-            one_past_max_index = index;
-        } else {
-            min_index = index + 1;
-        }
-    }
-
-    cursor->cell_num = min_index;
+    /* The cell with the key, or the position it would be inserted at */
+    cursor->cell_num = key_array_rank(leaf_node_key(node, 0), num_cells, key);
     return cursor;
 }
 
-uint32_t internal_node_find_child(void *node, uint32_t key) {
+uint32_t internal_node_find_child(void *node, Key key) {
     /*
   Return the index of the child which should contain
-  the given key.
+  the given key: the first whose key is at least key, or the right child
   */
+    return key_array_rank(
+        internal_node_key(node, 0), *internal_node_num_keys(node), key);
+}
 
-    uint32_t num_keys = *internal_node_num_keys(node);
-
-    /* Binary search */
-    uint32_t min_index = 0;
-    uint32_t max_index = num_keys; /* there is one more child than key */
+static void fences_error(Key key, uint32_t page_num) {
+    printf("Key %" KEY_FORMAT " is outside the fences of page %d.\n",
+           key,
+           page_num);
+    exit(EXIT_FAILURE);
+}
 
-    while (min_index != max_index) {
-        uint32_t index = (min_index + max_index) / 2;
-        uint32_t key_to_right = *internal_node_key(node, index);
-        if (key_to_right >= key) {
-            max_index = index;
-        } else {
-            min_index = index + 1;
-        }
+/*
+ * A key outside the fences of a node whose version checked out. While
+ * latching is on that can still be a change the versions did not cover, so
+ * the descent starts over from the root; without latching the tree is
+ * broken.
+ */
+static Cursor *fences_miss(Pager *pager, Key key, uint32_t page_num) {
+    if (!pager->latching) {
+        fences_error(key, page_num);
     }
+    return NULL;
+}
 
-    return min_index;
+/*
+ * internal_node_find_child and internal_node_child for a node read without
+ * a latch, which may be half changed: its counts are checked against the
+ * layout before they are used, and INVALID_PAGE_NUM stands for anything
+ * that does not add up. Only a node whose version checks out afterwards is
+ * known to be broken.
+ */
+static uint32_t unlatched_find_child(Table *table,
+                                     void *node,
+                                     Key key,
+                                     uint32_t *child_index) {
+    uint32_t max_keys = table->layout.internal_node_max_keys;
+    uint32_t num_keys = *internal_node_num_keys(node);
+    *child_index = 0;
+    if (*internal_node_max_keys(node) != max_keys || num_keys > max_keys) {
+        return INVALID_PAGE_NUM;
+    }
+    *child_index = key_array_rank(internal_node_key(node, 0), num_keys, key);
+    return *child_index == num_keys
+               ? *internal_node_right_child(node)
+               : *internal_node_child_slot(node, *child_index);
 }
 
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key) {
-    void *node = get_page(table->pager, page_num);
+/*
+ * Descend from a node to the leaf that should hold key. The nodes passed on
+ * the way and the child followed in each are kept in the cursor, so a split
+ * can find the parents of the leaf without storing them in pages.
+ *
+ * While latching is on, internal nodes are read without latches. Each step
+ * reads the child's version and then checks that the node's own did not
+ * change, so the child was the right one; the leaf is latched shared and
+ * checked against its parent the same way. version is the first node's,
+ * read before it. Returns NULL if a change got in the way or the key fell
+ * outside a node's fences, and the caller starts over from the root.
+ */
+Cursor *internal_node_find(Table *table,
+                           uint32_t page_num,
+                           uint64_t version,
+                           Key key) {
+    Pager *pager = table->pager;
+    uint32_t depth = 0;
+    uint32_t path_page_nums[BTREE_MAX_DEPTH];
+    uint32_t path_child_nums[BTREE_MAX_DEPTH];
+    uint64_t parent_version = 0;
+
+    void *node = get_page(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        if (depth == BTREE_MAX_DEPTH) {
+            printf("Tree is deeper than %d levels.\n", BTREE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t child_index;
+        uint32_t child_num =
+            unlatched_find_child(table, node, key, &child_index);
+        uint64_t child_version = page_version(pager, child_num);
+        bool contains = node_fences_contain(node, key);
+        bool valid = page_version_valid(pager, page_num, version);
+        unpin_page(pager, page_num);
+        if (!valid) {
+            return NULL;
+        }
+        if (child_num == INVALID_PAGE_NUM) {
+            printf("Tried to follow an invalid child of page %d\n", page_num);
+            exit(EXIT_FAILURE);
+        }
+        if (!contains) {
+            return fences_miss(pager, key, page_num);
+        }
+        path_page_nums[depth] = page_num;
+        path_child_nums[depth] = child_index;
+        depth++;
+
+        parent_version = version;
+        page_num = child_num;
+        version = child_version;
+        node = get_page(pager, page_num);
+    }
 
-    uint32_t child_index = internal_node_find_child(node, key);
-    uint32_t child_num = *internal_node_child(node, child_index);
-    void *child = get_page(table->pager, child_num);
-    switch (get_node_type(child)) {
-    case NODE_LEAF:
-        return leaf_node_find(table, child_num, key);
-    case NODE_INTERNAL:
-        return internal_node_find(table, child_num, key);
+    latch_page(pager, page_num, false);
+    bool contains = node_fences_contain(node, key);
+    bool valid = get_node_type(node) == NODE_LEAF &&
+                 page_version_valid(pager, page_num, version) &&
+                 (depth == 0 || page_version_valid(pager,
+                                                   path_page_nums[depth - 1],
+                                                   parent_version));
+    unpin_page(pager, page_num);
+    if (!valid) {
+        unlatch_page(pager, page_num);
+        return NULL;
+    }
+    if (!contains) {
+        unlatch_page(pager, page_num);
+        return fences_miss(pager, key, page_num);
     }
+
+    Cursor *cursor = leaf_node_find(table, page_num, key);
+    cursor->depth = depth;
+    cursor->latched = pager->latching;
+    memcpy(cursor->path_page_nums, path_page_nums, depth * sizeof(uint32_t));
+    memcpy(cursor->path_child_nums, path_child_nums, depth * sizeof(uint32_t));
+    return cursor;
 }
 
-void create_new_root(Table *table, uint32_t right_child_page_num) {
+void create_new_root(Table *table, Key left_child_max_key,
+                     uint32_t right_child_page_num) {
     /*
   Handle splitting the root.
   Old root copied to new page, becomes left child.
@@ -193,297 +463,388 @@ void create_new_root(Table *table, uint32_t right_child_page_num) {
   */
 
     void *root = get_page(table->pager, table->root_page_num);
-    void *right_child = get_page(table->pager, right_child_page_num);
     uint32_t left_child_page_num = get_unused_page_num(table->pager);
     void *left_child = get_page(table->pager, left_child_page_num);
 
-    if (get_node_type(root) == NODE_INTERNAL) {
-        initialize_internal_node(right_child);
-        initialize_internal_node(left_child);
-    }
-
-    /* Left child has data copied from old root */
-    memcpy(left_child, root, PAGE_SIZE);
+    /*
+  Left child has data copied from old root, including the high fence the
+  split just gave it
+  */
+    memcpy(left_child, root, table->pager->page_size);
     set_node_root(left_child, false);
-
-    if (get_node_type(left_child) == NODE_INTERNAL) {
-        void *child;
-        for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
-            child = get_page(table->pager, *internal_node_child(left_child, i));
-            *node_parent(child) = left_child_page_num;
-        }
-        child = get_page(table->pager, *internal_node_right_child(left_child));
-        *node_parent(child) = left_child_page_num;
+    if (get_node_type(left_child) == NODE_LEAF) {
+        /* The right half was linked back to the root page, not the copy */
+        latch_page(table->pager, right_child_page_num, true);
+        void *right_child = get_page(table->pager, right_child_page_num);
+        *leaf_node_prev_leaf(right_child) = left_child_page_num;
+        mark_page_dirty(table->pager, right_child_page_num);
+        unpin_page(table->pager, right_child_page_num);
+        unlatch_page(table->pager, right_child_page_num);
     }
 
     /* Root node is a new internal node with one key and two children */
-    initialize_internal_node(root);
+    page_change_begin(table->pager, table->root_page_num);
+    initialize_internal_node(root, table->pager->page_size);
     set_node_root(root, true);
     *internal_node_num_keys(root) = 1;
     *internal_node_child(root, 0) = left_child_page_num;
-    uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
     *internal_node_key(root, 0) = left_child_max_key;
     *internal_node_right_child(root) = right_child_page_num;
-    *node_parent(left_child) = table->root_page_num;
-    *node_parent(right_child) = table->root_page_num;
-}
+    set_internal_node_count(
+        root, 0, node_row_count(table->pager, left_child_page_num));
+    set_internal_node_count(
+        root, 1, node_row_count(table->pager, right_child_page_num));
+    page_change_end(table->pager, table->root_page_num);
+    /* The tree is a level deeper, so a remembered path is stale */
+    table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+    /* Lookups through the hash index find the copy once it is complete */
+    if (get_node_type(left_child) == NODE_LEAF && table->hash_index != NULL) {
+        hash_index_put_leaf(table->hash_index, left_child, left_child_page_num);
+    }
 
-void internal_node_split_and_insert(Table *table,
-                                    uint32_t parent_page_num,
-                                    uint32_t child_page_num);
+    mark_page_dirty(table->pager, left_child_page_num);
+    mark_page_dirty(table->pager, table->root_page_num);
+    unpin_page(table->pager, left_child_page_num);
+    unpin_page(table->pager, table->root_page_num);
+}
 
+static void internal_node_split_and_insert(Table *table,
+                                           Cursor *cursor,
+                                           uint32_t level,
+                                           Key left_child_max_key,
+                                           uint32_t right_child_page_num);
+
+/*
+ * A child of the node at the given level of the cursor's path has split.
+ * The child keeps its slot with its new max key, and the node that took its
+ * upper half goes into the slot after it under the child's old key. Both
+ * get their row counts from the nodes themselves.
+ */
 void internal_node_insert(Table *table,
-                          uint32_t parent_page_num,
-                          uint32_t child_page_num) {
-    /*
-  Add a new child/key pair to parent that corresponds to child
-  */
-
-    void *parent = get_page(table->pager, parent_page_num);
-    void *child = get_page(table->pager, child_page_num);
-    uint32_t child_max_key = get_node_max_key(table->pager, child);
-    uint32_t index = internal_node_find_child(parent, child_max_key);
-
-    uint32_t original_num_keys = *internal_node_num_keys(parent);
-
-    if (original_num_keys >= INTERNAL_NODE_MAX_KEYS) {
-        internal_node_split_and_insert(table, parent_page_num, child_page_num);
-        return;
-    }
+                          Cursor *cursor,
+                          uint32_t level,
+                          Key left_child_max_key,
+                          uint32_t right_child_page_num) {
+    uint32_t page_num = cursor->path_page_nums[level];
+    uint32_t index = cursor->path_child_nums[level];
+    void *node = get_page(table->pager, page_num);
+    uint32_t num_keys = *internal_node_num_keys(node);
 
-    uint32_t right_child_page_num = *internal_node_right_child(parent);
-    /*
-  An internal node with a right child of INVALID_PAGE_NUM is empty
-  */
-    if (right_child_page_num == INVALID_PAGE_NUM) {
-        *internal_node_right_child(parent) = child_page_num;
+    if (num_keys >= table->layout.internal_node_max_keys) {
+        unpin_page(table->pager, page_num);
+        internal_node_split_and_insert(
+            table, cursor, level, left_child_max_key, right_child_page_num);
         return;
     }
 
-    void *right_child = get_page(table->pager, right_child_page_num);
-    /*
-  If we are already at the max number of cells for a node, we cannot increment
-  before splitting. Incrementing without inserting a new key/child pair
-  and immediately calling internal_node_split_and_insert has the effect
-  of creating a new key at (max_cells + 1) with an uninitialized value
-  */
-    *internal_node_num_keys(parent) = original_num_keys + 1;
-
-    if (child_max_key > get_node_max_key(table->pager, right_child)) {
-        /* Replace right child */
-        *internal_node_child(parent, original_num_keys) = right_child_page_num;
-        *internal_node_key(parent, original_num_keys) =
-            get_node_max_key(table->pager, right_child);
-        *internal_node_right_child(parent) = child_page_num;
-    } else {
-        /* Make room for the new cell */
-        for (uint32_t i = original_num_keys; i > index; i--) {
-            void *destination = internal_node_cell(parent, i);
-            void *source = internal_node_cell(parent, i - 1);
-            memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
-        }
-        *internal_node_child(parent, index) = child_page_num;
-        *internal_node_key(parent, index) = child_max_key;
-    }
-}
-
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key) {
-    uint32_t old_child_index = internal_node_find_child(node, old_key);
-    *internal_node_key(node, old_child_index) = new_key;
+    page_change_begin(table->pager, page_num);
+    uint32_t left_child_page_num = *internal_node_child(node, index);
+    memmove(internal_node_key(node, index + 1),
+            internal_node_key(node, index),
+            (num_keys - index) * INTERNAL_NODE_KEY_SIZE);
+    memmove(internal_node_child_slot(node, index + 1),
+            internal_node_child_slot(node, index),
+            (num_keys - index) * INTERNAL_NODE_CHILD_SIZE);
+    memmove(internal_node_count(node, index + 1),
+            internal_node_count(node, index),
+            (num_keys + 1 - index) * INTERNAL_NODE_COUNT_SIZE);
+    *internal_node_num_keys(node) = num_keys + 1;
+    *internal_node_child_slot(node, index) = left_child_page_num;
+    *internal_node_key(node, index) = left_child_max_key;
+    *internal_node_child(node, index + 1) = right_child_page_num;
+    set_internal_node_count(
+        node, index, node_row_count(table->pager, left_child_page_num));
+    set_internal_node_count(
+        node, index + 1, node_row_count(table->pager, right_child_page_num));
+    page_change_end(table->pager, page_num);
+
+    mark_page_dirty(table->pager, page_num);
+    unpin_page(table->pager, page_num);
 }
 
-void internal_node_split_and_insert(Table *table,
-                                    uint32_t parent_page_num,
-                                    uint32_t child_page_num) {
-    uint32_t old_page_num = parent_page_num;
-    void *old_node = get_page(table->pager, parent_page_num);
-    uint32_t old_max = get_node_max_key(table->pager, old_node);
-
-    void *child = get_page(table->pager, child_page_num);
-    uint32_t child_max = get_node_max_key(table->pager, child);
-
+/*
+ * Split a full internal node around its middle key. The keys and children
+ * above it move to a new node in one copy each, the middle child becomes the old node's right
+ * child and the middle key becomes the old node's key in its parent. The
+ * pending child then goes into whichever half now holds the child that split.
+ */
+static void internal_node_split_and_insert(Table *table,
+                                           Cursor *cursor,
+                                           uint32_t level,
+                                           Key left_child_max_key,
+                                           uint32_t right_child_page_num) {
+    uint32_t old_page_num = cursor->path_page_nums[level];
+    void *old_node = get_page(table->pager, old_page_num);
     uint32_t new_page_num = get_unused_page_num(table->pager);
-
-    /*
-  Declaring a flag before updating pointers which
-  records whether this operation involves splitting the root -
-  if it does, we will insert our newly created node during
-  the step where the table's new root is created. If it does
-  not, we have to insert the newly created node into its parent
-  after the old node's keys have been transferred over. We are not
-  able to do this if the newly created node's parent is not a newly
-  initialized root node, because in that case its parent may have existing
-  keys aside from our old node which we are splitting. If that is true, we
-  need to find a place for our newly created node in its parent, and we
-  cannot insert it at the correct index if it does not yet have any keys
-  */
-    uint32_t splitting_root = is_node_root(old_node);
-
-    void *parent;
-    void *new_node;
-    if (splitting_root) {
-        create_new_root(table, new_page_num);
-        parent = get_page(table->pager, table->root_page_num);
-        /*
-    If we are splitting the root, we need to update old_node to point
-    to the new root's left child, new_page_num will already point to
-    the new root's right child
-    */
-        old_page_num = *internal_node_child(parent, 0);
-        old_node = get_page(table->pager, old_page_num);
-    } else {
-        parent = get_page(table->pager, *node_parent(old_node));
-        new_node = get_page(table->pager, new_page_num);
-        initialize_internal_node(new_node);
-    }
-
-    uint32_t *old_num_keys = internal_node_num_keys(old_node);
-
-    uint32_t cur_page_num = *internal_node_right_child(old_node);
-    void *cur = get_page(table->pager, cur_page_num);
-
-    /*
-  First put right child into new node and set right child of old node to invalid page number
-  */
-    internal_node_insert(table, new_page_num, cur_page_num);
-    *node_parent(cur) = new_page_num;
-    *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
-    /*
-  For each key until you get to the middle key, move the key and the child to the new node
-  */
-    for (int i = INTERNAL_NODE_MAX_KEYS - 1; i > INTERNAL_NODE_MAX_KEYS / 2;
-         i--) {
-        cur_page_num = *internal_node_child(old_node, i);
-        cur = get_page(table->pager, cur_page_num);
-
-        internal_node_insert(table, new_page_num, cur_page_num);
-        *node_parent(cur) = new_page_num;
-
-        (*old_num_keys)--;
+    void *new_node = get_page(table->pager, new_page_num);
+    initialize_internal_node(new_node, table->pager->page_size);
+
+    uint32_t num_keys = *internal_node_num_keys(old_node);
+    uint32_t index = cursor->path_child_nums[level];
+    uint32_t split = num_keys / 2;
+    if (index == num_keys &&
+        !(*node_fence_flags(old_node) & NODE_HAS_HIGH_FENCE)) {
+        /* Appending along the right edge: keep the old node full */
+        split = num_keys - 1;
     }
-
-    /*
-  Set child before middle key, which is now the highest key, to be node's right child,
-  and decrement number of keys
-  */
+    Key split_key = *internal_node_key(old_node, split);
+    page_change_begin(table->pager, old_page_num);
+    split_node_fences(old_node, new_node, split_key);
+    uint32_t num_moved = num_keys - split - 1;
+
+    memcpy(internal_node_key(new_node, 0),
+           internal_node_key(old_node, split + 1),
+           num_moved * INTERNAL_NODE_KEY_SIZE);
+    memcpy(internal_node_child_slot(new_node, 0),
+           internal_node_child_slot(old_node, split + 1),
+           num_moved * INTERNAL_NODE_CHILD_SIZE);
+    memcpy(internal_node_count(new_node, 0),
+           internal_node_count(old_node, split + 1),
+           (num_moved + 1) * INTERNAL_NODE_COUNT_SIZE);
+    *internal_node_num_keys(new_node) = num_moved;
+    *internal_node_right_child(new_node) = *internal_node_right_child(old_node);
     *internal_node_right_child(old_node) =
-        *internal_node_child(old_node, *old_num_keys - 1);
-    (*old_num_keys)--;
-
-    /*
-  Determine which of the two nodes after the split should contain the child to be inserted,
-  and insert the child
-  */
-    uint32_t max_after_split = get_node_max_key(table->pager, old_node);
-
-    uint32_t destination_page_num =
-        child_max < max_after_split ? old_page_num : new_page_num;
-
-    internal_node_insert(table, destination_page_num, child_page_num);
-    *node_parent(child) = destination_page_num;
-
-    update_internal_node_key(
-        parent, old_max, get_node_max_key(table->pager, old_node));
+        *internal_node_child_slot(old_node, split);
+    *internal_node_num_keys(old_node) = split;
+    page_change_end(table->pager, old_page_num);
+
+    mark_page_dirty(table->pager, new_page_num);
+    mark_page_dirty(table->pager, old_page_num);
+    unpin_page(table->pager, new_page_num);
+    unpin_page(table->pager, old_page_num);
+    /* The rightmost leaf may now be under the new node */
+    table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+
+    if (index > split) {
+        cursor->path_page_nums[level] = new_page_num;
+        cursor->path_child_nums[level] = index - split - 1;
+    }
+    internal_node_insert(
+        table, cursor, level, left_child_max_key, right_child_page_num);
 
-    if (!splitting_root) {
-        internal_node_insert(table, *node_parent(old_node), new_page_num);
-        *node_parent(new_node) = *node_parent(old_node);
+    if (level == 0) {
+        create_new_root(table, split_key, new_page_num);
+    } else {
+        internal_node_insert(table, cursor, level - 1, split_key, new_page_num);
     }
 }
 
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
+void leaf_node_split_and_insert(Cursor *cursor, Row *value) {
     /*
   Create a new node and move half the cells over.
   Insert the new value in one of the two nodes.
   Update parent or create a new parent.
   */
 
-    void *old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-    void *new_node = get_page(cursor->table->pager, new_page_num);
-    initialize_leaf_node(new_node);
-    *node_parent(new_node) = *node_parent(old_node);
-    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    Pager *pager = cursor->table->pager;
+    void *old_node = get_page(pager, cursor->page_num);
+    uint32_t new_page_num = get_unused_page_num(pager);
+    /* Readers reach the new leaf by the links below before it is filled */
+    latch_page(pager, new_page_num, true);
+    void *new_node = get_page(pager, new_page_num);
+    initialize_leaf_node(new_node, pager->page_size);
+    uint32_t next_page_num = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(new_node) = next_page_num;
+    *leaf_node_prev_leaf(new_node) = cursor->page_num;
     *leaf_node_next_leaf(old_node) = new_page_num;
+    if (next_page_num != 0) {
+        /* Leaves are latched left to right, as readers scanning them do */
+        latch_page(pager, next_page_num, true);
+        void *next_node = get_page(pager, next_page_num);
+        *leaf_node_prev_leaf(next_node) = new_page_num;
+        mark_page_dirty(pager, next_page_num);
+        unpin_page(pager, next_page_num);
+        unlatch_page(pager, next_page_num);
+    }
 
     /*
-  All existing keys plus new key should should be divided
-  evenly between old (left) and new (right) nodes.
-  Starting from the right, move each key to correct position.
+  Rebuild the old node from a copy. The cells and the new row are divided
+  by size, so each node ends up with about half of the bytes.
   */
-    for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-        void *destination_node;
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
+    void *copy = malloc(pager->page_size);
+    memcpy(copy, old_node, pager->page_size);
+    uint32_t num_cells = *leaf_node_num_cells(copy);
+    *leaf_node_num_cells(old_node) = 0;
+    *leaf_node_content_start(old_node) = pager->page_size;
+
+    uint32_t value_size = serialized_row_size(value);
+    uint32_t total_size = value_size + LEAF_NODE_SLOT_SIZE;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        total_size += leaf_node_cell_size(copy, i) + LEAF_NODE_SLOT_SIZE;
+    }
+
+    /*
+  An append past the end of the rightmost leaf leaves the old node full and
+  starts the new one with just the new row, so leaves filled in key order
+  stay full instead of half empty.
+  */
+    bool append = cursor->cell_num == num_cells &&
+                  !(*node_fence_flags(copy) & NODE_HAS_HIGH_FENCE);
+
+    uint32_t left_size = 0;
+    void *destination_node = old_node;
+    uint32_t value_page_num = cursor->page_num;
+    for (uint32_t i = 0; i <= num_cells; i++) {
+        bool is_new = i == cursor->cell_num;
+        uint32_t source_num = i < cursor->cell_num ? i : i - 1;
+        uint32_t size =
+            is_new ? value_size : leaf_node_cell_size(copy, source_num);
+
+        if (destination_node == old_node && left_size > 0 &&
+            (append ? is_new
+                    : left_size + size + LEAF_NODE_SLOT_SIZE >
+                          total_size / 2)) {
             destination_node = new_node;
-        } else {
-            destination_node = old_node;
         }
-        uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void *destination = leaf_node_cell(destination_node, index_within_node);
-
-        if (i == cursor->cell_num) {
-            serialize_row(value,
-                          leaf_node_value(destination_node, index_within_node));
-            *leaf_node_key(destination_node, index_within_node) = key;
-        } else if (i > cursor->cell_num) {
-            memcpy(destination,
-                   leaf_node_cell(old_node, i - 1),
-                   LEAF_NODE_CELL_SIZE);
+        if (destination_node == old_node) {
+            left_size += size + LEAF_NODE_SLOT_SIZE;
+        }
+
+        Key key = is_new ? value->id : *leaf_node_key(copy, source_num);
+        void *destination = leaf_node_insert_cell(
+            destination_node, *leaf_node_num_cells(destination_node), key, size);
+        if (is_new) {
+            serialize_row(value, destination);
+            if (destination_node == new_node) {
+                value_page_num = new_page_num;
+            }
         } else {
-            memcpy(
-                destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+            memcpy(destination, leaf_node_cell(copy, source_num), size);
         }
     }
-
-    /* Update cell count on both leaf nodes */
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-    if (is_node_root(old_node)) {
-        return create_new_root(cursor->table, new_page_num);
+    free(copy);
+
+    Key new_max =
+        *leaf_node_key(old_node, *leaf_node_num_cells(old_node) - 1);
+    split_node_fences(old_node, new_node, new_max);
+    if (cursor->table->hash_index != NULL) {
+        hash_index_put_leaf(cursor->table->hash_index, new_node, new_page_num);
+        hash_index_put(cursor->table->hash_index, value->id, value_page_num);
+    }
+    mark_page_dirty(pager, new_page_num);
+    mark_page_dirty(pager, cursor->page_num);
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, cursor->page_num);
+    unlatch_page(pager, new_page_num);
+
+    if (cursor->depth == 0) {
+        create_new_root(cursor->table, new_max, new_page_num);
     } else {
-        uint32_t parent_page_num = *node_parent(old_node);
-        uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
-        void *parent = get_page(cursor->table->pager, parent_page_num);
+        internal_node_insert(
+            cursor->table, cursor, cursor->depth - 1, new_max, new_page_num);
+    }
+}
 
-        update_internal_node_key(parent, old_max, new_max);
-        internal_node_insert(cursor->table, parent_page_num, new_page_num);
-        return;
+/*
+ * The first level of the cursor's path whose node an insert of size bytes
+ * changes beyond its row counts: the leaf's level if it has room, else the
+ * lowest ancestor the split stops at, or the root.
+ */
+static uint32_t insert_split_level(Cursor *cursor, uint32_t size) {
+    Pager *pager = cursor->table->pager;
+    void *node = get_page(pager, cursor->page_num);
+    bool fits = leaf_node_free_space(node) >= size + LEAF_NODE_SLOT_SIZE;
+    unpin_page(pager, cursor->page_num);
+
+    uint32_t level = cursor->depth;
+    while (!fits && level > 0) {
+        level--;
+        uint32_t page_num = cursor->path_page_nums[level];
+        void *parent = get_page(pager, page_num);
+        fits = *internal_node_num_keys(parent) <
+               cursor->table->layout.internal_node_max_keys;
+        unpin_page(pager, page_num);
     }
+    return level;
 }
 
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
+void leaf_node_insert(Cursor *cursor, Row *value) {
+    /*
+  Count the new row in every subtree on the path first. A split then sets
+  the counts of the nodes it divides from their contents.
+
+  The insert runs on the one writer, which reads pages without latching and
+  latches the pages it changes. Counts are changed under a short exclusive
+  latch; the nodes a split changes are latched top down and held until it
+  is done, so a reader crabbing down never sees a half split node.
+  */
+    Pager *pager = cursor->table->pager;
+    uint32_t size = serialized_row_size(value);
+    uint32_t split_level = insert_split_level(cursor, size);
+    uint32_t num_latched = 0;
+    uint32_t latched_page_nums[BTREE_MAX_DEPTH + 1];
+
+    for (uint32_t level = 0; level < cursor->depth; level++) {
+        uint32_t page_num = cursor->path_page_nums[level];
+        latch_page(pager, page_num, true);
+        void *parent = get_page(pager, page_num);
+        uint32_t child_num = cursor->path_child_nums[level];
+        set_internal_node_count(
+            parent, child_num, *internal_node_count(parent, child_num) + 1ULL);
+        mark_page_dirty(pager, page_num);
+        unpin_page(pager, page_num);
+        if (level < split_level) {
+            unlatch_page(pager, page_num);
+        } else {
+            latched_page_nums[num_latched++] = page_num;
+        }
+    }
+    latch_page(pager, cursor->page_num, true);
+    latched_page_nums[num_latched++] = cursor->page_num;
+
     void *node = get_page(cursor->table->pager, cursor->page_num);
 
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
+    if (leaf_node_free_space(node) < size + LEAF_NODE_SLOT_SIZE) {
         // Node full
-        leaf_node_split_and_insert(cursor, key, value);
-        return;
+        unpin_page(cursor->table->pager, cursor->page_num);
+        /*
+      A node's fences change when it splits, before its parent gets the
+      separator. Readers descending without latches must not pass a parent
+      in between, so every internal node the split reaches stays in a
+      change until it is done.
+      */
+        for (uint32_t i = 0; i + 1 < num_latched; i++) {
+            page_change_begin(pager, latched_page_nums[i]);
+        }
+        leaf_node_split_and_insert(cursor, value);
+        for (uint32_t i = num_latched - 1; i > 0; i--) {
+            page_change_end(pager, latched_page_nums[i - 1]);
+        }
+    } else {
+        serialize_row(value,
+                      leaf_node_insert_cell(
+                          node, cursor->cell_num, value->id, size));
+        if (cursor->table->hash_index != NULL) {
+            hash_index_put(
+                cursor->table->hash_index, value->id, cursor->page_num);
+        }
+        mark_page_dirty(cursor->table->pager, cursor->page_num);
+        unpin_page(cursor->table->pager, cursor->page_num);
     }
 
-    if (cursor->cell_num < num_cells) {
-        // Make room for new cell
-        for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-            memcpy(leaf_node_cell(node, i),
-                   leaf_node_cell(node, i - 1),
-                   LEAF_NODE_CELL_SIZE);
-        }
+    for (uint32_t i = 0; i < num_latched; i++) {
+        unlatch_page(pager, latched_page_nums[i]);
     }
+}
 
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+NodeLayout node_layout(uint32_t page_size) {
+    NodeLayout layout;
+    layout.leaf_node_space_for_cells = page_size - LEAF_NODE_HEADER_SIZE;
+    /* One more count than keys, for the right child */
+    layout.internal_node_max_keys =
+        (page_size - INTERNAL_NODE_HEADER_SIZE - INTERNAL_NODE_COUNT_SIZE) /
+        INTERNAL_NODE_CELL_SIZE;
+    return layout;
 }
 
-void print_constants(void) {
+void print_constants(Table *table) {
     printf("ROW_SIZE: %d\n", ROW_SIZE);
     printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
     printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+    printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n",
+           table->layout.leaf_node_space_for_cells);
+    printf("INTERNAL_NODE_MAX_KEYS: %d\n", table->layout.internal_node_max_keys);
 }
 
 void indent(uint32_t level) {
@@ -503,7 +864,7 @@ void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
         printf("- leaf (size %d)\n", num_keys);
         for (uint32_t i = 0; i < num_keys; i++) {
             indent(indentation_level + 1);
-            printf("- %d\n", *leaf_node_key(node, i));
+            printf("- %" KEY_FORMAT "\n", *leaf_node_key(node, i));
         }
         break;
     case (NODE_INTERNAL):
@@ -516,11 +877,16 @@ void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
                 print_tree(pager, child, indentation_level + 1);
 
                 indent(indentation_level + 1);
-                printf("- key %d\n", *internal_node_key(node, i));
+                printf("- key %" KEY_FORMAT "\n", *internal_node_key(node, i));
             }
             child = *internal_node_right_child(node);
             print_tree(pager, child, indentation_level + 1);
         }
         break;
+    case (NODE_INDEX_INTERNAL):
+    case (NODE_INDEX_LEAF):
+        /* Index nodes are never reached from the table's root */
+        break;
     }
+    unpin_page(pager, page_num);
 }
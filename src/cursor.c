@@ -1,35 +1,292 @@
 #include "cursor.h"
+#include "hash_index.h"
 
-Cursor *table_find(Table *table, uint32_t key) {
-    uint32_t root_page_num = table->root_page_num;
-    void *root_node = get_page(table->pager, root_page_num);
+/*
+ * A cursor keeps the leaf it points into pinned until it moves off that leaf
+ * or is closed, so cursor_value can hand out pointers into the page. While
+ * latching is on it also holds a shared latch on the leaf. The way down to
+ * it takes no latches, and starts over when a split changes a node on it.
+ */
+Cursor *table_find(Table *table, Key key) {
+    Pager *pager = table->pager;
+    while (true) {
+        uint32_t root_page_num = table->root_page_num;
+        uint64_t version = page_version(pager, root_page_num);
+        Cursor *cursor =
+            internal_node_find(table, root_page_num, version, key);
+        if (cursor != NULL) {
+            return cursor;
+        }
+        sched_yield();
+    }
+}
 
-    if (get_node_type(root_node) == NODE_LEAF) {
-        return leaf_node_find(table, root_page_num, key);
-    } else {
-        return internal_node_find(table, root_page_num, key);
+static void cursor_unlatch(Cursor *cursor) {
+    if (cursor->latched) {
+        unlatch_page(cursor->table->pager, cursor->page_num);
+        cursor->latched = false;
     }
 }
 
-Cursor *table_start(Table *table) {
-    Cursor *cursor = table_find(table, 0);
+/*
+ * The writer's lookup for an insert. It drops the cursor's latch: only the
+ * writer changes pages, so it reads them freely, and leaf_node_insert
+ * latches the nodes it changes. A lookup that ends at the rightmost leaf is
+ * remembered with its path for the append fast path.
+ */
+Cursor *table_find_insert(Table *table, Key key) {
+    Cursor *cursor = table_find_append(table, key);
+    if (cursor != NULL) {
+        return cursor;
+    }
+
+    cursor = table_find(table, key);
+    cursor_unlatch(cursor);
+    void *node = get_page(table->pager, cursor->page_num);
+    if (!(*node_fence_flags(node) & NODE_HAS_HIGH_FENCE)) {
+        table->rightmost_leaf_page_num = cursor->page_num;
+        table->rightmost_depth = cursor->depth;
+        memcpy(table->rightmost_path_page_nums,
+               cursor->path_page_nums,
+               cursor->depth * sizeof(uint32_t));
+    }
+    unpin_page(table->pager, cursor->page_num);
+
+    return cursor;
+}
+
+/*
+ * A cursor on the row with key, or NULL if there is none. With a hash index
+ * the leaf comes from one probe instead of a descent. A split may move the
+ * row between the probe and the latch, or turn a root leaf into an internal
+ * node, so a probe that misses falls back to the descent.
+ */
+Cursor *table_find_row(Table *table, Key key) {
+    Pager *pager = table->pager;
+    Cursor *cursor = NULL;
+    if (table->hash_index != NULL) {
+        uint32_t page_num = hash_index_get(table->hash_index, key);
+        if (page_num == 0) {
+            return NULL;
+        }
+        latch_page(pager, page_num, false);
+        void *node = get_page(pager, page_num);
+        if (get_node_type(node) == NODE_LEAF) {
+            cursor = leaf_node_find(table, page_num, key);
+            cursor->latched = pager->latching;
+        } else {
+            unlatch_page(pager, page_num);
+        }
+        unpin_page(pager, page_num);
+    }
+    if (cursor == NULL) {
+        cursor = table_find(table, key);
+    }
+
+    void *node = get_page(pager, cursor->page_num);
+    bool found = cursor->cell_num < *leaf_node_num_cells(node) &&
+                 *leaf_node_key(node, cursor->cell_num) == key;
+    unpin_page(pager, cursor->page_num);
+    if (!found && cursor->depth == 0 && table->hash_index != NULL &&
+        cursor->page_num != table->root_page_num) {
+        /* Found through the hash index, and the row has moved on */
+        cursor_close(cursor);
+        cursor = table_find(table, key);
+        node = get_page(pager, cursor->page_num);
+        found = cursor->cell_num < *leaf_node_num_cells(node) &&
+                *leaf_node_key(node, cursor->cell_num) == key;
+        unpin_page(pager, cursor->page_num);
+    }
+    if (!found) {
+        cursor_close(cursor);
+        return NULL;
+    }
+    return cursor;
+}
+
+/*
+ * Increasing ids all go to the end of the rightmost leaf, which the table
+ * remembers with its path once a lookup reaches it. An insert of such an
+ * id can go there without searching the internal nodes: on the right edge
+ * the path always follows the right child. Returns NULL when the fast path
+ * does not apply.
+ */
+Cursor *table_find_append(Table *table, Key key) {
+    uint32_t page_num = table->rightmost_leaf_page_num;
+    if (page_num == INVALID_PAGE_NUM) {
+        return NULL;
+    }
+
+    void *node = get_page(table->pager, page_num);
+    bool append = false;
+    if (get_node_type(node) == NODE_LEAF &&
+        !(*node_fence_flags(node) & NODE_HAS_HIGH_FENCE)) {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        append = num_cells > 0 ? key > *leaf_node_key(node, num_cells - 1)
+                               : node_fences_contain(node, key);
+    }
+    unpin_page(table->pager, page_num);
+
+    if (!append) {
+        return NULL;
+    }
+
+    Cursor *cursor = leaf_node_find(table, page_num, key);
+    cursor->depth = table->rightmost_depth;
+    for (uint32_t level = 0; level < cursor->depth; level++) {
+        uint32_t path_page_num = table->rightmost_path_page_nums[level];
+        void *parent = get_page(table->pager, path_page_num);
+        cursor->path_page_nums[level] = path_page_num;
+        cursor->path_child_nums[level] = *internal_node_num_keys(parent);
+        unpin_page(table->pager, path_page_num);
+    }
+    return cursor;
+}
+
+/*
+ * A cursor at the first row with an id of at least key. The leaf a lookup
+ * lands on may hold only smaller ids, and then that row is the first one of
+ * the next leaf.
+ */
+Cursor *table_seek(Table *table, Key key) {
+    Cursor *cursor = table_find(table, key);
 
     void *node = get_page(table->pager, cursor->page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
-    cursor->end_of_table = (num_cells == 0);
+    unpin_page(table->pager, cursor->page_num);
+
+    if (num_cells == 0) {
+        cursor->end_of_table = true;
+    } else if (cursor->cell_num == num_cells) {
+        cursor->cell_num = num_cells - 1;
+        cursor_advance(cursor);
+    }
+
+    return cursor;
+}
 
+/*
+ * A cursor at the last row with an id of at most key, for reading
+ * backwards.
+ */
+Cursor *table_seek_back(Table *table, Key key) {
+    Cursor *cursor = table_find(table, key);
+
+    void *node = get_page(table->pager, cursor->page_num);
+    bool found = cursor->cell_num < *leaf_node_num_cells(node) &&
+                 *leaf_node_key(node, cursor->cell_num) == key;
+    unpin_page(table->pager, cursor->page_num);
+
+    if (!found) {
+        cursor_retreat(cursor);
+    }
+    return cursor;
+}
+
+/*
+ * The number of rows with an id below key, from one descent: the counts of
+ * the children left of the path at each level, then the position in the
+ * leaf. This is also the position key has or would have in id order.
+ */
+uint64_t table_rank(Table *table, Key key) {
+    Pager *pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    latch_page(pager, page_num, false);
+    void *node = get_page(pager, page_num);
+    uint64_t rank = 0;
+
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t child_index = internal_node_find_child(node, key);
+        for (uint32_t i = 0; i < child_index; i++) {
+            rank += *internal_node_count(node, i);
+        }
+        uint32_t child_num = *internal_node_child(node, child_index);
+        latch_page(pager, child_num, false);
+        unlatch_page(pager, page_num);
+        unpin_page(pager, page_num);
+        page_num = child_num;
+        node = get_page(pager, page_num);
+    }
+    rank += key_array_rank(
+        leaf_node_key(node, 0), *leaf_node_num_cells(node), key);
+    unpin_page(pager, page_num);
+    unlatch_page(pager, page_num);
+
+    return rank;
+}
+
+/*
+ * The number of rows in the table, from the counts in the root.
+ */
+uint64_t table_row_count(Table *table) {
+    latch_page(table->pager, table->root_page_num, false);
+    uint64_t count = node_row_count(table->pager, table->root_page_num);
+    unlatch_page(table->pager, table->root_page_num);
+    return count;
+}
+
+/*
+ * A cursor at the row with the given position in id order, counting from
+ * 0, from one descent that skips whole subtrees by their row counts. Past
+ * the last row the cursor is at the end of the table.
+ */
+Cursor *table_seek_position(Table *table, uint64_t position) {
+    Pager *pager = table->pager;
+    Cursor *cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->depth = 0;
+
+    uint32_t page_num = table->root_page_num;
+    latch_page(pager, page_num, false);
+    void *node = get_page(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        if (cursor->depth == BTREE_MAX_DEPTH) {
+            printf("Tree is deeper than %d levels.\n", BTREE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t num_keys = *internal_node_num_keys(node);
+        uint32_t child_index = 0;
+        while (child_index < num_keys &&
+               position >= *internal_node_count(node, child_index)) {
+            position -= *internal_node_count(node, child_index);
+            child_index++;
+        }
+        cursor->path_page_nums[cursor->depth] = page_num;
+        cursor->path_child_nums[cursor->depth] = child_index;
+        cursor->depth++;
+
+        uint32_t child_num = *internal_node_child(node, child_index);
+        latch_page(pager, child_num, false);
+        unlatch_page(pager, page_num);
+        unpin_page(pager, page_num);
+        page_num = child_num;
+        node = get_page(pager, page_num);
+    }
+
+    /* The cursor keeps the leaf pinned and latched */
+    cursor->page_num = page_num;
+    cursor->latched = pager->latching;
+    cursor->end_of_table = position >= *leaf_node_num_cells(node);
+    cursor->cell_num = cursor->end_of_table ? 0 : position;
     return cursor;
 }
 
+Cursor *table_start(Table *table) {
+    return table_seek(table, 0);
+}
+
 void *cursor_value(Cursor *cursor) {
     uint32_t page_num = cursor->page_num;
     void *page = get_page(cursor->table->pager, page_num);
-    return leaf_node_value(page, cursor->cell_num);
+    void *value = leaf_node_value(page, cursor->cell_num);
+    unpin_page(cursor->table->pager, page_num);
+    return value;
 }
 
 void cursor_advance(Cursor *cursor) {
+    Pager *pager = cursor->table->pager;
     uint32_t page_num = cursor->page_num;
-    void *node = get_page(cursor->table->pager, page_num);
+    void *node = get_page(pager, page_num);
 
     cursor->cell_num += 1;
     if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
@@ -39,8 +296,74 @@ void cursor_advance(Cursor *cursor) {
             /* This was rightmost leaf */
             cursor->end_of_table = true;
         } else {
+            /* Move the cursor's pin and latch over to the next leaf */
+            if (cursor->latched) {
+                latch_page(pager, next_page_num, false);
+                unlatch_page(pager, page_num);
+            }
+            get_page(pager, next_page_num);
+            unpin_page(pager, page_num);
             cursor->page_num = next_page_num;
             cursor->cell_num = 0;
         }
     }
+    unpin_page(pager, page_num);
+}
+
+/*
+ * Step back one row. Moving off the first row of the table sets
+ * end_of_table, as moving off the last one does for cursor_advance.
+ *
+ * Leaves are latched left to right, so a latched cursor lets go of its leaf
+ * before it latches the one before. A split may put a new leaf in between
+ * meanwhile, and then it looks again.
+ */
+void cursor_retreat(Cursor *cursor) {
+    Pager *pager = cursor->table->pager;
+    uint32_t page_num = cursor->page_num;
+    void *node = get_page(pager, page_num);
+
+    if (cursor->cell_num > 0) {
+        cursor->cell_num -= 1;
+        unpin_page(pager, page_num);
+        return;
+    }
+
+    while (true) {
+        uint32_t prev_page_num = *leaf_node_prev_leaf(node);
+        if (prev_page_num == 0) {
+            /* This was the leftmost leaf */
+            cursor->end_of_table = true;
+            break;
+        }
+        if (!cursor->latched) {
+            /* Move the cursor's pin over to the previous leaf */
+            void *prev = get_page(pager, prev_page_num);
+            unpin_page(pager, page_num);
+            cursor->page_num = prev_page_num;
+            cursor->cell_num = *leaf_node_num_cells(prev) - 1;
+            break;
+        }
+
+        unlatch_page(pager, page_num);
+        latch_page(pager, prev_page_num, false);
+        void *prev = get_page(pager, prev_page_num);
+        if (get_node_type(prev) == NODE_LEAF &&
+            *leaf_node_next_leaf(prev) == page_num) {
+            unpin_page(pager, page_num);
+            cursor->page_num = prev_page_num;
+            cursor->cell_num = *leaf_node_num_cells(prev) - 1;
+            break;
+        }
+        unpin_page(pager, prev_page_num);
+        unlatch_page(pager, prev_page_num);
+        latch_page(pager, page_num, false);
+    }
+    unpin_page(pager, page_num);
+}
+
+void cursor_close(Cursor *cursor) {
+    unpin_page(cursor->table->pager, cursor->page_num);
+    cursor_unlatch(cursor);
+    free(cursor);
 }
@@ -1,6 +1,10 @@
 #include "db.h"
 #include "pager.h"
 #include "btree.h"
+#include "index.h"
+#include "hash_index.h"
+#include "pool.h"
+#include "snapshot.h"
 
 InputBuffer *new_input_buffer(void) {
     InputBuffer *input_buff = malloc(sizeof(InputBuffer));
@@ -30,63 +34,175 @@ void close_input_buffer(InputBuffer *input_buffer) {
     free(input_buffer);
 }
 
+void print_header(Table *table) {
+    Pager *pager = table->pager;
+    printf("format version: %d\n", DB_FORMAT_VERSION);
+    printf("page size: %d\n", pager->page_size);
+    printf("key bits: %d\n", KEY_BITS);
+    printf("pages: %d\n", pager->num_pages);
+    printf("root page: %d\n", pager->header.root_page_num);
+    printf("free pages: %d\n", pager->header.freelist_count);
+    printf("rows: %llu\n", (unsigned long long)pager->header.row_count);
+    for (uint32_t column = 0; column < NUM_INDEX_COLUMNS; column++) {
+        if (pager->header.index_root_page_nums[column] != 0) {
+            printf("%s index root page: %d\n",
+                   index_column_name(column),
+                   pager->header.index_root_page_nums[column]);
+        }
+    }
+}
+
 void print_row(Row *row) {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+    printf("(%" KEY_FORMAT ", %s, %s)\n", row->id, row->username, row->email);
+}
+
+uint32_t serialized_row_size(Row *source) {
+    return ID_SIZE + FIELD_LENGTH_SIZE + strlen(source->username) +
+           FIELD_LENGTH_SIZE + strlen(source->email);
+}
+
+static void *serialize_field(void *destination, const char *field) {
+    uint8_t length = strlen(field);
+    *(uint8_t *)destination = length;
+    memcpy(destination + FIELD_LENGTH_SIZE, field, length);
+    return destination + FIELD_LENGTH_SIZE + length;
 }
 
-void serialize_row(Row *source, void *destination) {
+static void *deserialize_field(void *source, char *field) {
+    uint8_t length = *(uint8_t *)source;
+    memcpy(field, source + FIELD_LENGTH_SIZE, length);
+    field[length] = '\0';
+    return source + FIELD_LENGTH_SIZE + length;
+}
+
+/*
+ * Returns the number of bytes written, which is serialized_row_size.
+ */
+uint32_t serialize_row(Row *source, void *destination) {
     memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-    memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-    memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+    void *end = serialize_field(destination + ID_SIZE, source->username);
+    end = serialize_field(end, source->email);
+    return end - destination;
 }
 
 void deserialize_row(void *source, Row *destination) {
     memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+    void *next = deserialize_field(source + ID_SIZE, destination->username);
+    deserialize_field(next, destination->email);
 }
 
-Table *db_open(const char *filename) {
-    Pager *pager = pager_open(filename);
+/*
+ * Size of the serialized row at source.
+ */
+uint32_t row_record_size(void *source) {
+    uint32_t username_length = *(uint8_t *)(source + ID_SIZE);
+    uint32_t email_length =
+        *(uint8_t *)(source + ID_SIZE + FIELD_LENGTH_SIZE + username_length);
+    return ID_SIZE + FIELD_LENGTH_SIZE + username_length + FIELD_LENGTH_SIZE +
+           email_length;
+}
+
+uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Fletcher style checksum over 32-bit words, continuing from seed.
+ */
+uint64_t fletcher_checksum(uint64_t seed, const void *data, uint32_t length) {
+    uint32_t s1 = seed;
+    uint32_t s2 = seed >> 32;
+    for (uint32_t i = 0; i + sizeof(uint32_t) <= length; i += sizeof(uint32_t)) {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(uint32_t));
+        s1 += word;
+        s2 += s1;
+    }
+    return ((uint64_t)s2 << 32) | s1;
+}
+
+DbOptions db_default_options(void) {
+    DbOptions options;
+    options.page_size = PAGER_DEFAULT_PAGE_SIZE;
+    options.cache_pages = PAGER_DEFAULT_CACHE_PAGES;
+    options.use_mmap = false;
+    options.mmap_size = PAGER_DEFAULT_MMAP_SIZE;
+    options.use_wal = true;
+    options.wal_group_commits = WAL_DEFAULT_GROUP_COMMITS;
+    options.async_commit = false;
+    options.flush_rate = PAGER_DEFAULT_FLUSH_RATE;
+    options.hash_index = false;
+    options.concurrent_readers = false;
+    options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    return options;
+}
+
+Table *db_open(const char *filename, const DbOptions *options) {
+    Pager *pager = pager_open(filename, options);
 
     Table *table = malloc(sizeof(Table));
     table->pager = pager;
-    table->root_page_num = 0;
-
-    if (pager->num_pages == 0) {
-        // New database file. Initialize page 0 as leaf node.
-        void *root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
+    table->root_page_num = pager->header.root_page_num;
+    table->layout = node_layout(pager->page_size);
+    table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+    table->hash_index = NULL;
+    /* The thread running a statement works alongside the pool's workers */
+    uint32_t threads = options->threads;
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > POOL_MAX_THREADS) {
+        threads = POOL_MAX_THREADS;
+    }
+    table->pool = pool_create(threads - 1);
+    pthread_rwlock_init(&table->lock, NULL);
+
+    if (table->root_page_num == 0) {
+        // New database file. The first page after the header is the root.
+        uint32_t root_page_num = get_unused_page_num(pager);
+        void *root_node = get_page(pager, root_page_num);
+        initialize_leaf_node(root_node, pager->page_size);
         set_node_root(root_node, true);
+        mark_page_dirty(pager, root_page_num);
+        unpin_page(pager, root_page_num);
+        pager->header.root_page_num = root_page_num;
+        table->root_page_num = root_page_num;
+        pager_commit(pager);
+    }
+
+    if (options->hash_index) {
+        hash_index_build(table);
     }
 
     return table;
 }
 
 void db_close(Table *table) {
-    Pager *pager = table->pager;
-
-    for (uint32_t i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
-        }
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
-    }
+    pool_destroy(table->pool);
+    pager_close(table->pager);
+    hash_index_free(table->hash_index);
+    pthread_rwlock_destroy(&table->lock);
+    free(table);
+}
 
-    int result = close(pager->file_descriptor);
-    if (result == -1) {
-        printf("Error closing db file.\n");
+/*
+ * Bracket one read by a thread other than the one running statements, such
+ * as a lookup or a scan with the cursor functions. It sees the table as of
+ * the last commit and runs alongside inserts, which latch the pages they
+ * change; commands that rewrite the file, like .vacuum, wait for it. The
+ * database must have been opened with concurrent_readers.
+ */
+void db_read_begin(Table *table, Snapshot *snapshot) {
+    if (!table->pager->latching) {
+        printf("Database was not opened for concurrent readers.\n");
         exit(EXIT_FAILURE);
     }
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void *page = pager->pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = NULL;
-        }
-    }
-    free(pager);
-    free(table);
+    pthread_rwlock_rdlock(&table->lock);
+    snapshot_begin(table->pager, snapshot);
+}
+
+void db_read_end(Table *table, Snapshot *snapshot) {
+    snapshot_end(table->pager, snapshot);
+    pthread_rwlock_unlock(&table->lock);
 }
@@ -0,0 +1,146 @@
+#include "hash_index.h"
+
+/*
+ * Fibonacci hashing: the top bits of the key times 2^64 / phi pick the
+ * slot, which spreads runs of consecutive ids over the whole table.
+ */
+static uint64_t hash_slot(HashIndex *index, Key key) {
+    return ((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> index->shift;
+}
+
+static void hash_index_insert(HashIndex *index, Key key, uint32_t page_num);
+
+static void hash_index_resize(HashIndex *index, uint64_t num_slots) {
+    HashSlot *old_slots = index->slots;
+    uint64_t old_num_slots = index->num_slots;
+
+    index->slots = calloc(num_slots, sizeof(HashSlot));
+    if (index->slots == NULL) {
+        printf("Unable to allocate a hash index of %" PRIu64 " slots.\n",
+               num_slots);
+        exit(EXIT_FAILURE);
+    }
+    index->num_slots = num_slots;
+    index->shift = 64 - __builtin_ctzll(num_slots);
+    index->num_keys = 0;
+
+    for (uint64_t i = 0; i < old_num_slots; i++) {
+        if (old_slots[i].page_num != 0) {
+            hash_index_insert(index, old_slots[i].key, old_slots[i].page_num);
+        }
+    }
+    free(old_slots);
+}
+
+/*
+ * The leaf holding key, or 0 if no row has it. Reader threads may look up
+ * keys while the writer adds them, so lookups share the index lock.
+ */
+uint32_t hash_index_get(HashIndex *index, Key key) {
+    pthread_rwlock_rdlock(&index->lock);
+    uint64_t mask = index->num_slots - 1;
+    uint32_t page_num;
+    for (uint64_t i = hash_slot(index, key);; i = (i + 1) & mask) {
+        HashSlot *slot = &index->slots[i];
+        if (slot->page_num == 0 || slot->key == key) {
+            page_num = slot->page_num;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&index->lock);
+    return page_num;
+}
+
+/*
+ * Add key or move it to another leaf. The table doubles before it is half
+ * full, so probe runs stay short.
+ */
+static void hash_index_insert(HashIndex *index, Key key, uint32_t page_num) {
+    if ((index->num_keys + 1) * 2 > index->num_slots) {
+        hash_index_resize(index, index->num_slots * 2);
+    }
+
+    uint64_t mask = index->num_slots - 1;
+    for (uint64_t i = hash_slot(index, key);; i = (i + 1) & mask) {
+        HashSlot *slot = &index->slots[i];
+        if (slot->page_num == 0) {
+            slot->key = key;
+            slot->page_num = page_num;
+            index->num_keys++;
+            return;
+        }
+        if (slot->key == key) {
+            slot->page_num = page_num;
+            return;
+        }
+    }
+}
+
+void hash_index_put(HashIndex *index, Key key, uint32_t page_num) {
+    pthread_rwlock_wrlock(&index->lock);
+    hash_index_insert(index, key, page_num);
+    pthread_rwlock_unlock(&index->lock);
+}
+
+/*
+ * Point every key of a leaf at it, as after its cells moved there.
+ */
+void hash_index_put_leaf(HashIndex *index, void *node, uint32_t page_num) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    pthread_rwlock_wrlock(&index->lock);
+    for (uint32_t i = 0; i < num_cells; i++) {
+        hash_index_insert(index, *leaf_node_key(node, i), page_num);
+    }
+    pthread_rwlock_unlock(&index->lock);
+}
+
+/*
+ * Fill the index from the leaf chain, starting over if it exists. Used when
+ * the database is opened and after rows were moved in bulk.
+ */
+void hash_index_build(Table *table) {
+    Pager *pager = table->pager;
+    HashIndex *index = table->hash_index;
+    if (index == NULL) {
+        index = calloc(1, sizeof(HashIndex));
+        pthread_rwlock_init(&index->lock, NULL);
+        table->hash_index = index;
+    }
+
+    uint64_t num_slots = HASH_INDEX_MIN_SLOTS;
+    while (num_slots < pager->header.row_count * 2 + 2) {
+        num_slots *= 2;
+    }
+    free(index->slots);
+    index->slots = NULL;
+    index->num_slots = 0;
+    hash_index_resize(index, num_slots);
+
+    uint32_t page_num = table->root_page_num;
+    void *node = get_page(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t child_page_num = *internal_node_child(node, 0);
+        unpin_page(pager, page_num);
+        page_num = child_page_num;
+        node = get_page(pager, page_num);
+    }
+
+    while (true) {
+        hash_index_put_leaf(index, node, page_num);
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        unpin_page(pager, page_num);
+        if (next_page_num == 0) {
+            break;
+        }
+        page_num = next_page_num;
+        node = get_page(pager, page_num);
+    }
+}
+
+void hash_index_free(HashIndex *index) {
+    if (index != NULL) {
+        pthread_rwlock_destroy(&index->lock);
+        free(index->slots);
+        free(index);
+    }
+}
@@ -0,0 +1,479 @@
+#include "index.h"
+
+static const char *INDEX_COLUMN_NAMES[NUM_INDEX_COLUMNS] = {
+    "username",
+    "email",
+};
+
+/*
+ * An index entry. value is not terminated and points into a page or into
+ * a buffer of the caller.
+ */
+typedef struct {
+    const char *value;
+    uint32_t length;
+    Key id;
+} IndexEntry;
+
+/*
+ * The internal index nodes above a leaf, root first, and the cell followed
+ * in each, so a split can find the parents of the leaf.
+ */
+typedef struct {
+    uint32_t depth;
+    uint32_t page_nums[BTREE_MAX_DEPTH];
+    uint32_t child_nums[BTREE_MAX_DEPTH];
+} IndexPath;
+
+const char *index_column_name(IndexColumn column) {
+    return INDEX_COLUMN_NAMES[column];
+}
+
+bool index_column_from_name(const char *name, IndexColumn *column) {
+    for (uint32_t i = 0; i < NUM_INDEX_COLUMNS; i++) {
+        if (strcmp(name, INDEX_COLUMN_NAMES[i]) == 0) {
+            *column = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *row_column_value(Row *row, IndexColumn column) {
+    return column == INDEX_USERNAME ? row->username : row->email;
+}
+
+bool index_exists(Table *table, IndexColumn column) {
+    return table->pager->header.index_root_page_nums[column] != 0;
+}
+
+/*
+ * The first bytes of a value, big-endian and padded with zeros, so prefixes
+ * compare like the values they start.
+ */
+static Key index_prefix(const IndexEntry *entry) {
+    Key prefix = 0;
+    for (uint32_t i = 0; i < sizeof(Key); i++) {
+        uint8_t byte = i < entry->length ? (uint8_t)entry->value[i] : 0;
+        prefix = (prefix << 8) | byte;
+    }
+    return prefix;
+}
+
+static int compare_entries(const IndexEntry *a, const IndexEntry *b) {
+    uint32_t length = a->length < b->length ? a->length : b->length;
+    int result = memcmp(a->value, b->value, length);
+    if (result != 0) {
+        return result;
+    }
+    if (a->length != b->length) {
+        return a->length < b->length ? -1 : 1;
+    }
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+static uint32_t entry_size(const IndexEntry *entry) {
+    return FIELD_LENGTH_SIZE + entry->length + ID_SIZE;
+}
+
+static void copy_entry(IndexEntry *destination,
+                       char *buffer,
+                       const IndexEntry *source) {
+    memcpy(buffer, source->value, source->length);
+    destination->value = buffer;
+    destination->length = source->length;
+    destination->id = source->id;
+}
+
+static bool is_index_internal(void *node) {
+    return get_node_type(node) == NODE_INDEX_INTERNAL;
+}
+
+static uint32_t *index_node_right_child(void *node) {
+    return leaf_node_next_leaf(node);
+}
+
+static uint32_t *index_node_child(void *node, uint32_t child_num) {
+    if (child_num == *leaf_node_num_cells(node)) {
+        return index_node_right_child(node);
+    }
+    return leaf_node_cell(node, child_num);
+}
+
+static IndexEntry index_node_entry(void *node, uint32_t cell_num) {
+    uint8_t *source = leaf_node_cell(node, cell_num);
+    if (is_index_internal(node)) {
+        source += INDEX_NODE_CHILD_SIZE;
+    }
+    IndexEntry entry;
+    entry.length = source[0];
+    entry.value = (const char *)source + FIELD_LENGTH_SIZE;
+    memcpy(&entry.id, source + FIELD_LENGTH_SIZE + entry.length, ID_SIZE);
+    return entry;
+}
+
+static void initialize_index_node(void *node,
+                                  NodeType type,
+                                  uint32_t page_size) {
+    initialize_leaf_node(node, page_size);
+    set_node_type(node, type);
+    if (type == NODE_INDEX_INTERNAL) {
+        *index_node_right_child(node) = INVALID_PAGE_NUM;
+    }
+}
+
+/*
+ * Put an entry at cell_num, with the child it is the largest entry of in an
+ * internal node. Returns false if the node has no room for it.
+ */
+static bool index_node_insert_cell(void *node,
+                                   uint32_t cell_num,
+                                   uint32_t child_page_num,
+                                   const IndexEntry *entry) {
+    bool internal = is_index_internal(node);
+    uint32_t size = entry_size(entry) + (internal ? INDEX_NODE_CHILD_SIZE : 0);
+    if (leaf_node_free_space(node) < size + LEAF_NODE_SLOT_SIZE) {
+        return false;
+    }
+
+    uint8_t *cell =
+        leaf_node_insert_cell(node, cell_num, index_prefix(entry), size);
+    if (internal) {
+        memcpy(cell, &child_page_num, INDEX_NODE_CHILD_SIZE);
+        cell += INDEX_NODE_CHILD_SIZE;
+    }
+    cell[0] = entry->length;
+    memcpy(cell + FIELD_LENGTH_SIZE, entry->value, entry->length);
+    memcpy(cell + FIELD_LENGTH_SIZE + entry->length, &entry->id, ID_SIZE);
+    return true;
+}
+
+/*
+ * The first cell whose entry is at least entry, or the number of cells.
+ * The prefixes bound the cells that can tie with it, and only those are
+ * compared in full.
+ */
+static uint32_t index_node_find(void *node, const IndexEntry *entry) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    const Key *prefixes = leaf_node_key(node, 0);
+    Key prefix = index_prefix(entry);
+    uint32_t low = key_array_rank(prefixes, num_cells, prefix);
+    uint32_t high = prefix == KEY_MAX
+                        ? num_cells
+                        : low + key_array_rank(prefixes + low,
+                                               num_cells - low,
+                                               prefix + 1);
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        IndexEntry middle_entry = index_node_entry(node, middle);
+        if (compare_entries(&middle_entry, entry) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/*
+ * Descend to the leaf where entry belongs, keeping the path to it.
+ */
+static uint32_t index_find_leaf(Pager *pager,
+                                uint32_t root_page_num,
+                                const IndexEntry *entry,
+                                IndexPath *path) {
+    uint32_t page_num = root_page_num;
+    void *node = get_page(pager, page_num);
+    path->depth = 0;
+    while (is_index_internal(node)) {
+        if (path->depth == BTREE_MAX_DEPTH) {
+            printf("Index is deeper than %d levels.\n", BTREE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t child_num = index_node_find(node, entry);
+        path->page_nums[path->depth] = page_num;
+        path->child_nums[path->depth] = child_num;
+        path->depth++;
+
+        uint32_t child_page_num = *index_node_child(node, child_num);
+        unpin_page(pager, page_num);
+        page_num = child_page_num;
+        node = get_page(pager, page_num);
+    }
+    unpin_page(pager, page_num);
+    return page_num;
+}
+
+/*
+ * Split a full index node and the cell that did not fit between the node
+ * and a new right sibling, dividing the cells by size. In a leaf the
+ * separator is the last entry left in the node; in an internal node it is
+ * the middle cell, whose child becomes the node's right child. Returns the
+ * new page.
+ */
+static uint32_t index_node_split(Pager *pager,
+                                 uint32_t page_num,
+                                 uint32_t cell_num,
+                                 uint32_t child_page_num,
+                                 const IndexEntry *entry,
+                                 IndexEntry *separator,
+                                 char *separator_value) {
+    void *node = get_page(pager, page_num);
+    NodeType type = get_node_type(node);
+    bool internal = type == NODE_INDEX_INTERNAL;
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page(pager, new_page_num);
+    initialize_index_node(new_node, type, pager->page_size);
+
+    void *copy = malloc(pager->page_size);
+    memcpy(copy, node, pager->page_size);
+    uint32_t num_cells = *leaf_node_num_cells(copy);
+    uint32_t child_size = internal ? INDEX_NODE_CHILD_SIZE : 0;
+    initialize_index_node(node, type, pager->page_size);
+    set_node_root(node, is_node_root(copy));
+
+    uint32_t total_size = entry_size(entry) + child_size + LEAF_NODE_SLOT_SIZE;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        IndexEntry cell_entry = index_node_entry(copy, i);
+        total_size += entry_size(&cell_entry) + child_size + LEAF_NODE_SLOT_SIZE;
+    }
+
+    uint32_t left_size = 0;
+    void *destination_node = node;
+    for (uint32_t i = 0; i <= num_cells; i++) {
+        bool is_new = i == cell_num;
+        uint32_t source_num = i < cell_num ? i : i - 1;
+        IndexEntry cell_entry =
+            is_new ? *entry : index_node_entry(copy, source_num);
+        uint32_t cell_child = 0;
+        if (internal) {
+            cell_child = is_new ? child_page_num
+                                : *index_node_child(copy, source_num);
+        }
+        uint32_t size = entry_size(&cell_entry) + child_size + LEAF_NODE_SLOT_SIZE;
+
+        if (destination_node == node && left_size > 0 &&
+            left_size + size > total_size / 2) {
+            destination_node = new_node;
+            if (internal) {
+                *index_node_right_child(node) = cell_child;
+                copy_entry(separator, separator_value, &cell_entry);
+                continue;
+            }
+        }
+        if (destination_node == node) {
+            left_size += size;
+        }
+        index_node_insert_cell(destination_node,
+                               *leaf_node_num_cells(destination_node),
+                               cell_child,
+                               &cell_entry);
+    }
+
+    if (internal) {
+        *index_node_right_child(new_node) = *index_node_right_child(copy);
+    } else {
+        IndexEntry last = index_node_entry(node, *leaf_node_num_cells(node) - 1);
+        copy_entry(separator, separator_value, &last);
+
+        uint32_t next_page_num = *leaf_node_next_leaf(copy);
+        *leaf_node_next_leaf(new_node) = next_page_num;
+        *leaf_node_prev_leaf(new_node) = page_num;
+        *leaf_node_prev_leaf(node) = *leaf_node_prev_leaf(copy);
+        *leaf_node_next_leaf(node) = new_page_num;
+        if (next_page_num != 0) {
+            void *next_node = get_page(pager, next_page_num);
+            *leaf_node_prev_leaf(next_node) = new_page_num;
+            mark_page_dirty(pager, next_page_num);
+            unpin_page(pager, next_page_num);
+        }
+    }
+    free(copy);
+
+    mark_page_dirty(pager, new_page_num);
+    mark_page_dirty(pager, page_num);
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, page_num);
+    return new_page_num;
+}
+
+/*
+ * The root split: its left half moves to a new page and the root page
+ * becomes an internal node over the two halves, so the root page number in
+ * the header stays the same.
+ */
+static void index_create_new_root(Pager *pager,
+                                  uint32_t root_page_num,
+                                  const IndexEntry *separator,
+                                  uint32_t right_page_num) {
+    void *root = get_page(pager, root_page_num);
+    uint32_t left_page_num = get_unused_page_num(pager);
+    void *left = get_page(pager, left_page_num);
+    memcpy(left, root, pager->page_size);
+    set_node_root(left, false);
+    if (!is_index_internal(left)) {
+        void *right = get_page(pager, right_page_num);
+        *leaf_node_prev_leaf(right) = left_page_num;
+        mark_page_dirty(pager, right_page_num);
+        unpin_page(pager, right_page_num);
+    }
+
+    initialize_index_node(root, NODE_INDEX_INTERNAL, pager->page_size);
+    set_node_root(root, true);
+    *index_node_right_child(root) = right_page_num;
+    index_node_insert_cell(root, 0, left_page_num, separator);
+
+    mark_page_dirty(pager, left_page_num);
+    mark_page_dirty(pager, root_page_num);
+    unpin_page(pager, left_page_num);
+    unpin_page(pager, root_page_num);
+}
+
+/*
+ * Add the entry for a row to an index. A node that splits keeps its place
+ * in the parent under its new largest entry, and its new sibling takes the
+ * old one; that may split the parent in turn.
+ */
+void index_insert(Table *table, IndexColumn column, const char *value, Key id) {
+    Pager *pager = table->pager;
+    uint32_t root_page_num = pager->header.index_root_page_nums[column];
+    IndexEntry entry = {value, strlen(value), id};
+    char entry_value[UINT8_MAX];
+    IndexEntry separator;
+    char separator_value[UINT8_MAX];
+
+    IndexPath path;
+    uint32_t page_num = index_find_leaf(pager, root_page_num, &entry, &path);
+    void *node = get_page(pager, page_num);
+    uint32_t cell_num = index_node_find(node, &entry);
+    uint32_t child_page_num = 0;
+    uint32_t level = path.depth;
+
+    while (!index_node_insert_cell(node, cell_num, child_page_num, &entry)) {
+        unpin_page(pager, page_num);
+        uint32_t new_page_num = index_node_split(pager,
+                                                 page_num,
+                                                 cell_num,
+                                                 child_page_num,
+                                                 &entry,
+                                                 &separator,
+                                                 separator_value);
+        if (level == 0) {
+            index_create_new_root(pager, root_page_num, &separator, new_page_num);
+            return;
+        }
+
+        level--;
+        child_page_num = page_num;
+        copy_entry(&entry, entry_value, &separator);
+        page_num = path.page_nums[level];
+        cell_num = path.child_nums[level];
+        node = get_page(pager, page_num);
+        *index_node_child(node, cell_num) = new_page_num;
+    }
+
+    mark_page_dirty(pager, page_num);
+    unpin_page(pager, page_num);
+}
+
+void index_insert_row(Table *table, Row *row) {
+    for (uint32_t column = 0; column < NUM_INDEX_COLUMNS; column++) {
+        if (index_exists(table, column)) {
+            index_insert(table, column, row_column_value(row, column), row->id);
+        }
+    }
+}
+
+/*
+ * Start an index on a column and add an entry for every row, read in one
+ * scan of the table.
+ */
+void index_create(Table *table, IndexColumn column) {
+    Pager *pager = table->pager;
+    uint32_t root_page_num = get_unused_page_num(pager);
+    void *root = get_page(pager, root_page_num);
+    initialize_index_node(root, NODE_INDEX_LEAF, pager->page_size);
+    set_node_root(root, true);
+    mark_page_dirty(pager, root_page_num);
+    unpin_page(pager, root_page_num);
+    pager->header.index_root_page_nums[column] = root_page_num;
+
+    Cursor *cursor = table_start(table);
+    Row row;
+    while (!cursor->end_of_table) {
+        deserialize_row(cursor_value(cursor), &row);
+        index_insert(table, column, row_column_value(&row, column), row.id);
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+}
+
+static void index_free_node(Pager *pager, uint32_t page_num) {
+    void *node = get_page(pager, page_num);
+    if (is_index_internal(node)) {
+        for (uint32_t i = 0; i <= *leaf_node_num_cells(node); i++) {
+            index_free_node(pager, *index_node_child(node, i));
+        }
+    }
+    unpin_page(pager, page_num);
+    free_page(pager, page_num);
+}
+
+/*
+ * Free every page of an index.
+ */
+void index_drop(Table *table, IndexColumn column) {
+    Pager *pager = table->pager;
+    index_free_node(pager, pager->header.index_root_page_nums[column]);
+    pager->header.index_root_page_nums[column] = 0;
+}
+
+/*
+ * The ids of the rows whose column holds value, in id order. They are the
+ * entries from the first one at least (value, 0) up to the next value, read
+ * along the leaf chain. Returns a malloc'd array.
+ */
+Key *index_lookup(Table *table,
+                  IndexColumn column,
+                  const char *value,
+                  uint64_t *num_ids) {
+    Pager *pager = table->pager;
+    IndexEntry target = {value, strlen(value), 0};
+    IndexPath path;
+    uint32_t page_num = index_find_leaf(
+        pager, pager->header.index_root_page_nums[column], &target, &path);
+    void *node = get_page(pager, page_num);
+    uint32_t cell_num = index_node_find(node, &target);
+
+    uint64_t capacity = 16;
+    Key *ids = malloc(capacity * sizeof(Key));
+    *num_ids = 0;
+    while (true) {
+        if (cell_num == *leaf_node_num_cells(node)) {
+            uint32_t next_page_num = *leaf_node_next_leaf(node);
+            unpin_page(pager, page_num);
+            if (next_page_num == 0) {
+                return ids;
+            }
+            page_num = next_page_num;
+            node = get_page(pager, page_num);
+            cell_num = 0;
+            continue;
+        }
+
+        IndexEntry entry = index_node_entry(node, cell_num);
+        if (entry.length != target.length ||
+            memcmp(entry.value, target.value, target.length) != 0) {
+            break;
+        }
+        if (*num_ids == capacity) {
+            capacity *= 2;
+            ids = realloc(ids, capacity * sizeof(Key));
+        }
+        ids[(*num_ids)++] = entry.id;
+        cell_num++;
+    }
+    unpin_page(pager, page_num);
+    return ids;
+}
@@ -0,0 +1,298 @@
+#include "load.h"
+#include "vm.h"
+
+/*
+ * A finished node of the level being built, the largest key under it,
+ * which becomes its key in the level above, and its number of rows.
+ */
+typedef struct {
+    uint32_t page_num;
+    Key max_key;
+    uint64_t num_rows;
+} LoadEntry;
+
+typedef struct {
+    LoadEntry *entries;
+    uint32_t num_entries;
+    uint32_t capacity;
+} LoadLevel;
+
+static void level_append(LoadLevel *level,
+                         uint32_t page_num,
+                         Key max_key,
+                         uint64_t num_rows) {
+    if (level->num_entries == level->capacity) {
+        level->capacity = level->capacity ? level->capacity * 2 : 64;
+        level->entries =
+            realloc(level->entries, level->capacity * sizeof(LoadEntry));
+    }
+    level->entries[level->num_entries].page_num = page_num;
+    level->entries[level->num_entries].max_key = max_key;
+    level->entries[level->num_entries].num_rows = num_rows;
+    level->num_entries++;
+}
+
+/*
+ * Read the next row of a load file: one "<id> <username> <email>" per line,
+ * the fields of an insert statement. Blank lines are skipped. Returns false
+ * at the end of the file.
+ */
+static bool read_load_row(FILE *file,
+                          char **line,
+                          size_t *line_length,
+                          uint32_t *line_num,
+                          Row *row,
+                          prepare_result *result) {
+    while (getline(line, line_length, file) != -1) {
+        (*line_num)++;
+        char *id_string = strtok(*line, " \t\r\n");
+        if (id_string == NULL) {
+            continue;
+        }
+        char *username = strtok(NULL, " \t\r\n");
+        char *email = strtok(NULL, " \t\r\n");
+        *result = parse_row(id_string, username, email, row);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Check every row and the key order before anything is written, so a bad
+ * file leaves the table as it was. Returns the number of rows, or -1.
+ */
+static int64_t check_load_file(FILE *file) {
+    char *line = NULL;
+    size_t line_length = 0;
+    uint32_t line_num = 0;
+    int64_t num_rows = 0;
+    Key prev_key = 0;
+    Row row;
+    prepare_result result;
+
+    while (read_load_row(file, &line, &line_length, &line_num, &row, &result)) {
+        if (result != PREPARE_SUCCESS) {
+            printf("Invalid row on line %d.\n", line_num);
+            num_rows = -1;
+            break;
+        }
+        if (num_rows > 0 && row.id <= prev_key) {
+            printf("Rows must be sorted by id with no duplicates (line %d).\n",
+                   line_num);
+            num_rows = -1;
+            break;
+        }
+        prev_key = row.id;
+        num_rows++;
+    }
+
+    free(line);
+    return num_rows;
+}
+
+/*
+ * Fill leaves left to right up to fill_percent of their space, each on a
+ * page allocated as the previous one is finished and linked both ways, and commit each leaf as
+ * it is done so the buffer pool never holds more than one.
+ */
+static void load_leaves(Table *table,
+                        FILE *file,
+                        uint32_t fill_percent,
+                        LoadLevel *leaves) {
+    Pager *pager = table->pager;
+    uint32_t fill_bytes =
+        (uint64_t)table->layout.leaf_node_space_for_cells * fill_percent / 100;
+    char *line = NULL;
+    size_t line_length = 0;
+    uint32_t line_num = 0;
+    Row row;
+    prepare_result result;
+
+    uint32_t page_num = get_unused_page_num(pager);
+    void *node = get_page(pager, page_num);
+    initialize_leaf_node(node, pager->page_size);
+
+    while (read_load_row(file, &line, &line_length, &line_num, &row, &result)) {
+        uint32_t size = serialized_row_size(&row) + LEAF_NODE_SLOT_SIZE;
+        uint32_t used =
+            table->layout.leaf_node_space_for_cells - leaf_node_free_space(node);
+
+        if (*leaf_node_num_cells(node) > 0 && used + size > fill_bytes) {
+            /* Finish this leaf; another one follows */
+            Key max_key =
+                *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+            uint32_t next_page_num = get_unused_page_num(pager);
+            *leaf_node_next_leaf(node) = next_page_num;
+            *node_high_fence(node) = max_key;
+            *node_fence_flags(node) |= NODE_HAS_HIGH_FENCE;
+            mark_page_dirty(pager, page_num);
+            unpin_page(pager, page_num);
+            level_append(
+                leaves, page_num, max_key, *leaf_node_num_cells(node));
+            pager_commit(pager);
+
+            node = get_page(pager, next_page_num);
+            initialize_leaf_node(node, pager->page_size);
+            *leaf_node_prev_leaf(node) = page_num;
+            page_num = next_page_num;
+            *node_low_fence(node) = max_key;
+            *node_fence_flags(node) = NODE_HAS_LOW_FENCE;
+        }
+
+        serialize_row(&row,
+                      leaf_node_insert_cell(node,
+                                            *leaf_node_num_cells(node),
+                                            row.id,
+                                            size - LEAF_NODE_SLOT_SIZE));
+    }
+
+    Key max_key = *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    mark_page_dirty(pager, page_num);
+    unpin_page(pager, page_num);
+    level_append(leaves, page_num, max_key, *leaf_node_num_cells(node));
+    pager_commit(pager);
+    free(line);
+}
+
+/*
+ * Point an internal node at children[0, num_children) of a level. The key
+ * of each child but the last goes in the node; the last is its right child.
+ * Returns the number of rows under the node.
+ */
+static uint64_t fill_internal_node(void *node, LoadEntry *children,
+                                   uint32_t num_children) {
+    uint64_t num_rows = 0;
+    *internal_node_num_keys(node) = num_children - 1;
+    for (uint32_t i = 0; i + 1 < num_children; i++) {
+        *internal_node_child_slot(node, i) = children[i].page_num;
+        *internal_node_key(node, i) = children[i].max_key;
+    }
+    *internal_node_right_child(node) = children[num_children - 1].page_num;
+    for (uint32_t i = 0; i < num_children; i++) {
+        set_internal_node_count(node, i, children[i].num_rows);
+        num_rows += children[i].num_rows;
+    }
+    return num_rows;
+}
+
+/*
+ * Build the internal levels over a level of nodes, spreading the children
+ * evenly over as few nodes as the fill factor allows. The level that fits
+ * in one node is written into the root page.
+ */
+static void load_internal_levels(Table *table,
+                                 uint32_t fill_percent,
+                                 LoadLevel *level) {
+    Pager *pager = table->pager;
+    uint32_t max_children = table->layout.internal_node_max_keys + 1;
+    uint32_t fill_children = max_children * fill_percent / 100;
+
+    while (level->num_entries > max_children) {
+        LoadLevel parents = {NULL, 0, 0};
+        uint32_t num_nodes =
+            (level->num_entries + fill_children - 1) / fill_children;
+        uint32_t first = 0;
+
+        for (uint32_t n = 0; n < num_nodes; n++) {
+            uint32_t num_children = level->num_entries / num_nodes +
+                                    (n < level->num_entries % num_nodes);
+            LoadEntry *children = level->entries + first;
+            uint32_t page_num = get_unused_page_num(pager);
+            void *node = get_page(pager, page_num);
+            initialize_internal_node(node, pager->page_size);
+            uint64_t num_rows =
+                fill_internal_node(node, children, num_children);
+
+            if (first > 0) {
+                *node_low_fence(node) = children[-1].max_key;
+                *node_fence_flags(node) |= NODE_HAS_LOW_FENCE;
+            }
+            if (n + 1 < num_nodes) {
+                *node_high_fence(node) = children[num_children - 1].max_key;
+                *node_fence_flags(node) |= NODE_HAS_HIGH_FENCE;
+            }
+
+            mark_page_dirty(pager, page_num);
+            unpin_page(pager, page_num);
+            level_append(&parents,
+                         page_num,
+                         children[num_children - 1].max_key,
+                         num_rows);
+            pager_commit(pager);
+            first += num_children;
+        }
+
+        free(level->entries);
+        *level = parents;
+    }
+
+    void *root = get_page(pager, table->root_page_num);
+    if (level->num_entries == 1) {
+        /* A single leaf: it becomes the root */
+        uint32_t page_num = level->entries[0].page_num;
+        void *leaf = get_page(pager, page_num);
+        memcpy(root, leaf, pager->page_size);
+        unpin_page(pager, page_num);
+        free_page(pager, page_num);
+    } else {
+        initialize_internal_node(root, pager->page_size);
+        fill_internal_node(root, level->entries, level->num_entries);
+    }
+    set_node_root(root, true);
+    mark_page_dirty(pager, table->root_page_num);
+    unpin_page(pager, table->root_page_num);
+}
+
+/*
+ * Build the tree bottom up from a file of rows sorted by id: leaves are
+ * packed in order and each internal level is built in one pass over the
+ * level below, with no lookups and no splits. The table must be empty. The
+ * root page is written last, so a crash part way through leaves an empty
+ * table.
+ */
+void table_bulk_load(Table *table, const char *filename, uint32_t fill_percent) {
+    Pager *pager = table->pager;
+    void *root = get_page(pager, table->root_page_num);
+    bool empty = get_node_type(root) == NODE_LEAF &&
+                 *leaf_node_num_cells(root) == 0;
+    unpin_page(pager, table->root_page_num);
+    if (!empty) {
+        printf("Table must be empty to load.\n");
+        return;
+    }
+
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        printf("Unable to open '%s'.\n", filename);
+        return;
+    }
+
+    int64_t num_rows = check_load_file(file);
+    if (num_rows > 0) {
+        rewind(file);
+        LoadLevel level = {NULL, 0, 0};
+        load_leaves(table, file, fill_percent, &level);
+        load_internal_levels(table, fill_percent, &level);
+        free(level.entries);
+        table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+
+        /* Indexes of the empty table get their entries from the new rows */
+        for (uint32_t column = 0; column < NUM_INDEX_COLUMNS; column++) {
+            if (index_exists(table, column)) {
+                index_drop(table, column);
+                index_create(table, column);
+            }
+        }
+
+        pager->header.row_count += num_rows;
+        if (table->hash_index != NULL) {
+            hash_index_build(table);
+        }
+        pager_commit(pager);
+    }
+    fclose(file);
+
+    if (num_rows >= 0) {
+        printf("Loaded %lld rows.\n", (long long)num_rows);
+    }
+}
@@ -3,13 +3,44 @@
 #include "query.h"
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
+    DbOptions options = db_default_options();
+    char *filename = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            options.page_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc) {
+            options.cache_pages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options.use_mmap = true;
+        } else if (strcmp(argv[i], "--mmap-size") == 0 && i + 1 < argc) {
+            options.mmap_size = strtoull(argv[++i], NULL, 10) << 20;
+        } else if (strcmp(argv[i], "--no-wal") == 0) {
+            options.use_wal = false;
+        } else if (strcmp(argv[i], "--wal-group") == 0 && i + 1 < argc) {
+            options.wal_group_commits = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--async-commit") == 0) {
+            options.async_commit = true;
+        } else if (strcmp(argv[i], "--flush-rate") == 0 && i + 1 < argc) {
+            options.flush_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hash-index") == 0) {
+            options.hash_index = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.threads = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            printf("Unrecognized option '%s'\n", argv[i]);
+            exit(EXIT_FAILURE);
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    if (filename == NULL) {
         printf("Must supply a database filename.\n");
         exit(EXIT_FAILURE);
     }
 
-    char *filename = argv[1];
-    Table *table = db_open(filename);
+    Table *table = db_open(filename, &options);
 
     InputBuffer *input_buffer = new_input_buffer();
     while (true) {
@@ -33,6 +64,9 @@ int main(int argc, char *argv[]) {
         case (PREPARE_NEGATIVE_ID):
             printf("ID must be positive.\n");
             continue;
+        case (PREPARE_ID_TOO_LARGE):
+            printf("ID is too large.\n");
+            continue;
         case (PREPARE_STRING_TOO_LONG):
             printf("String is too long.\n");
             continue;
@@ -52,6 +86,9 @@ int main(int argc, char *argv[]) {
         case (EXECUTE_DUPLICATE_KEY):
             printf("Error: Duplicate key.\n");
             break;
+        case (EXECUTE_INDEX_EXISTS):
+            printf("Error: Index already exists.\n");
+            break;
         }
     }
 }
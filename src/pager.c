@@ -1,51 +1,1301 @@
 #include "pager.h"
+#include "snapshot.h"
 
-void *get_page(Pager *pager, uint32_t page_num) {
-    if (page_num > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d > %d\n",
-               page_num,
-               TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
+/* Pins the calling thread holds */
+static __thread uint32_t thread_pins;
+
+/*
+ * The page table is split into stripes by page number, each an open
+ * addressing hash table with linear probing that maps resident page numbers
+ * to frames. A stripe grows to stay at most half full, so probe sequences
+ * stay short. Entries are added and removed with both the pager lock and
+ * the stripe's lock held, so either is enough to look one up.
+ */
+static uint32_t page_hash(uint32_t page_num) {
+    return page_num * 2654435761u;
+}
+
+static PageTableStripe *page_table_stripe(Pager *pager, uint32_t page_num) {
+    return &pager->page_table[(page_hash(page_num) >> 16) %
+                              PAGER_PAGE_TABLE_STRIPES];
+}
+
+static uint32_t stripe_lookup(PageTableStripe *stripe, uint32_t page_num) {
+    uint32_t slot = page_hash(page_num) & stripe->mask;
+    while (stripe->entries[slot].page_num != INVALID_PAGE_NUM) {
+        if (stripe->entries[slot].page_num == page_num) {
+            return stripe->entries[slot].frame_num;
+        }
+        slot = (slot + 1) & stripe->mask;
+    }
+    return INVALID_PAGE_NUM;
+}
+
+static void stripe_insert(PageTableStripe *stripe,
+                          uint32_t page_num,
+                          uint32_t frame_num) {
+    uint32_t slot = page_hash(page_num) & stripe->mask;
+    while (stripe->entries[slot].page_num != INVALID_PAGE_NUM) {
+        slot = (slot + 1) & stripe->mask;
+    }
+    stripe->entries[slot].page_num = page_num;
+    stripe->entries[slot].frame_num = frame_num;
+    stripe->num_entries++;
+}
+
+static void stripe_resize(PageTableStripe *stripe, uint32_t size) {
+    PageTableEntry *old_entries = stripe->entries;
+    uint32_t old_size = old_entries != NULL ? stripe->mask + 1 : 0;
+
+    stripe->entries = malloc(size * sizeof(PageTableEntry));
+    for (uint32_t i = 0; i < size; i++) {
+        stripe->entries[i].page_num = INVALID_PAGE_NUM;
+    }
+    stripe->mask = size - 1;
+    stripe->num_entries = 0;
+    for (uint32_t i = 0; i < old_size; i++) {
+        if (old_entries[i].page_num != INVALID_PAGE_NUM) {
+            stripe_insert(stripe, old_entries[i].page_num,
+                          old_entries[i].frame_num);
+        }
+    }
+    free(old_entries);
+}
+
+static uint32_t page_table_lookup(Pager *pager, uint32_t page_num) {
+    return stripe_lookup(page_table_stripe(pager, page_num), page_num);
+}
+
+static void page_table_insert(Pager *pager, uint32_t page_num,
+                              uint32_t frame_num) {
+    PageTableStripe *stripe = page_table_stripe(pager, page_num);
+    pthread_mutex_lock(&stripe->lock);
+    if (2 * (stripe->num_entries + 1) > stripe->mask + 1) {
+        stripe_resize(stripe, 2 * (stripe->mask + 1));
+    }
+    stripe_insert(stripe, page_num, frame_num);
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+/*
+ * Take a frame's page out of the page table unless it is pinned. Pins are
+ * only taken through the table, under the stripe lock, so once it is out
+ * nobody can pin the frame until it holds another page.
+ */
+static bool page_table_remove(Pager *pager, Frame *frame) {
+    uint32_t page_num = frame->page_num;
+    PageTableStripe *stripe = page_table_stripe(pager, page_num);
+    pthread_mutex_lock(&stripe->lock);
+    if (__atomic_load_n(&frame->pin_count, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_unlock(&stripe->lock);
+        return false;
+    }
+
+    uint32_t slot = page_hash(page_num) & stripe->mask;
+    while (stripe->entries[slot].page_num != page_num) {
+        if (stripe->entries[slot].page_num == INVALID_PAGE_NUM) {
+            pthread_mutex_unlock(&stripe->lock);
+            return true;
+        }
+        slot = (slot + 1) & stripe->mask;
+    }
+
+    /*
+  Backward shift deletion: pull later entries of the probe sequence into
+  the hole so lookups never stop early at an empty slot
+  */
+    uint32_t hole = slot;
+    uint32_t next = (hole + 1) & stripe->mask;
+    while (stripe->entries[next].page_num != INVALID_PAGE_NUM) {
+        uint32_t home =
+            page_hash(stripe->entries[next].page_num) & stripe->mask;
+        if (((next - home) & stripe->mask) >= ((next - hole) & stripe->mask)) {
+            stripe->entries[hole] = stripe->entries[next];
+            hole = next;
+        }
+        next = (next + 1) & stripe->mask;
+    }
+    stripe->entries[hole].page_num = INVALID_PAGE_NUM;
+    stripe->num_entries--;
+    pthread_mutex_unlock(&stripe->lock);
+    return true;
+}
+
+/*
+ * Pin the frame holding page_num if it is resident, taking only the lock of
+ * its stripe. Returns the frame number, or INVALID_PAGE_NUM, with the
+ * page's data and whether another thread is still reading it from the file.
+ */
+static uint32_t page_table_pin(Pager *pager,
+                               uint32_t page_num,
+                               void **data,
+                               bool *loading) {
+    PageTableStripe *stripe = page_table_stripe(pager, page_num);
+    pthread_mutex_lock(&stripe->lock);
+    uint32_t frame_num = stripe_lookup(stripe, page_num);
+    if (frame_num != INVALID_PAGE_NUM) {
+        Frame *frame = &pager->frames[frame_num];
+        __atomic_add_fetch(&frame->pin_count, 1, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&frame->referenced, true, __ATOMIC_RELAXED);
+        *data = frame->data;
+        *loading = __atomic_load_n(&frame->loading, __ATOMIC_ACQUIRE);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return frame_num;
+}
+
+/*
+ * Write a run of consecutive pages starting at first_page with one pwritev,
+ * looping over short writes. Returns the file offset just past the run.
+ */
+static off_t write_run(int fd,
+                       uint32_t page_size,
+                       uint32_t first_page,
+                       struct iovec *iov,
+                       int iovcnt) {
+    off_t offset = (off_t)first_page * page_size;
+
+    while (iovcnt > 0) {
+        ssize_t bytes_written = pwritev(fd, iov, iovcnt, offset);
+
+        if (bytes_written == -1) {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+
+        offset += bytes_written;
+        while (iovcnt > 0 && (size_t)bytes_written >= iov->iov_len) {
+            bytes_written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base += bytes_written;
+            iov->iov_len -= bytes_written;
+        }
+    }
+
+    return offset;
+}
+
+/*
+ * Make the log durable up to the latest commit and wake the statements
+ * waiting for it. Called with the lock held; the fdatasync runs without it
+ * so readers and asynchronous commits carry on while it waits on the disk,
+ * and callers look at the pool again afterwards.
+ */
+static void sync_wal(Pager *pager) {
+    Wal *wal = pager->wal;
+    if (wal == NULL) {
+        return;
+    }
+
+    if (wal->synced_seq != wal->commit_seq) {
+        uint64_t target = wal->commit_seq;
+        int fd = wal->file_descriptor;
+        pthread_mutex_unlock(&pager->lock);
+        if (fdatasync(fd) == -1) {
+            printf("Error syncing WAL: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_lock(&pager->lock);
+        if (wal->synced_seq < target) {
+            wal->synced_seq = target;
+        }
+    }
+    /* Statements may also have been synced by an eviction */
+    pthread_cond_broadcast(&pager->wal_synced);
+}
+
+/*
+ * Whether the log records of a frame's last commit are durable, so its page
+ * may be written.
+ */
+static bool frame_synced(Pager *pager, Frame *frame) {
+    return pager->wal == NULL || frame->commit_seq <= pager->wal->synced_seq;
+}
+
+static void write_pages(Pager *pager,
+                        uint32_t first_page,
+                        struct iovec *iov,
+                        int iovcnt) {
+    /*
+     * Write-ahead rule: the log must be durable before the pages it covers.
+     * Callers only write frames that are frame_synced, syncing the log
+     * with sync_wal first where needed, so no sync waits under the lock.
+     */
+
+    off_t end = write_run(
+        pager->file_descriptor, pager->page_size, first_page, iov, iovcnt);
+    if ((uint64_t)end > pager->file_length) {
+        pager->file_length = end;
+    }
+}
+
+/*
+ * Account for a page image reaching the database file.
+ */
+static void frame_written(Pager *pager, Frame *frame) {
+    frame->dirty = false;
+    if (frame->checkpoint) {
+        frame->checkpoint = false;
+        pager->checkpoint_pages--;
+    }
+}
+
+/*
+ * The flusher writes from a private copy without holding the lock. Anything
+ * that writes a page itself waits for that to land first, so an older image
+ * can never overwrite a newer one.
+ */
+static void wait_for_flusher(Pager *pager) {
+    while (pager->flush_in_progress) {
+        pthread_cond_wait(&pager->write_done, &pager->lock);
+    }
+}
+
+static void write_frame(Pager *pager, Frame *frame) {
+    struct iovec iov = {.iov_base = frame->data, .iov_len = pager->page_size};
+    write_pages(pager, frame->page_num, &iov, 1);
+    frame_written(pager, frame);
+}
+
+/*
+ * Size each stripe for its share of the frames, at most half full.
+ */
+static void page_table_init(Pager *pager) {
+    uint32_t size = 8;
+    while (size < 4 * pager->num_frames / PAGER_PAGE_TABLE_STRIPES) {
+        size <<= 1;
+    }
+    for (uint32_t i = 0; i < PAGER_PAGE_TABLE_STRIPES; i++) {
+        pthread_mutex_init(&pager->page_table[i].lock, NULL);
+        pager->page_table[i].entries = NULL;
+        stripe_resize(&pager->page_table[i], size);
+    }
+}
+
+static void page_table_free(Pager *pager) {
+    for (uint32_t i = 0; i < PAGER_PAGE_TABLE_STRIPES; i++) {
+        pthread_mutex_destroy(&pager->page_table[i].lock);
+        free(pager->page_table[i].entries);
+    }
+}
+
+static void init_frame(Frame *frame, void *data) {
+    frame->data = data;
+    frame->page_num = INVALID_PAGE_NUM;
+    frame->pin_count = 0;
+    frame->referenced = false;
+    frame->dirty = false;
+    frame->uncommitted = false;
+    frame->writing = false;
+    frame->checkpoint = false;
+    frame->loading = false;
+    frame->commit_seq = 0;
+}
+
+/*
+ * Pages changed by the statement in progress cannot be evicted, so when they
+ * crowd out every other frame the pool grows past its budget instead of
+ * failing. release_overflow_frames gives the memory back after the commit.
+ */
+static uint32_t add_overflow_frame(Pager *pager) {
+    if (pager->num_frames == pager->frames_capacity) {
+        /* Threads pinning pages index frames under their stripe's lock */
+        for (uint32_t i = 0; i < PAGER_PAGE_TABLE_STRIPES; i++) {
+            pthread_mutex_lock(&pager->page_table[i].lock);
+        }
+        pager->frames_capacity *= 2;
+        pager->frames =
+            realloc(pager->frames, pager->frames_capacity * sizeof(Frame));
+        for (uint32_t i = 0; i < PAGER_PAGE_TABLE_STRIPES; i++) {
+            pthread_mutex_unlock(&pager->page_table[i].lock);
+        }
+        pager->txn_pages = realloc(pager->txn_pages,
+                                   pager->frames_capacity * sizeof(uint32_t));
     }
 
-    if (pager->pages[page_num] == NULL) {
-        // Cache miss. Allocate memory and load from file.
-        void *page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
+    uint32_t frame_num = pager->num_frames++;
+    init_frame(&pager->frames[frame_num], malloc(pager->page_size));
+    return frame_num;
+}
 
-        // We might save a partial page at the end of the file
-        if (pager->file_length % PAGE_SIZE) {
-            num_pages += 1;
+static void release_overflow_frames(Pager *pager) {
+    for (uint32_t i = pager->cache_pages; i < pager->num_frames; i++) {
+        Frame *frame = &pager->frames[i];
+        if (frame->dirty && !frame_synced(pager, frame)) {
+            sync_wal(pager);
+            break;
+        }
+    }
+
+    while (pager->num_frames > pager->cache_pages) {
+        Frame *frame = &pager->frames[pager->num_frames - 1];
+        if (frame->writing) {
+            break;
+        }
+        if (frame->page_num != INVALID_PAGE_NUM) {
+            if (!page_table_remove(pager, frame)) {
+                break;
+            }
+            if (frame->dirty) {
+                write_frame(pager, frame);
+            }
+        }
+        free(frame->data);
+        pager->num_frames--;
+    }
+    pager->clock_hand %= pager->num_frames;
+}
+
+/*
+ * Pick a frame to hold a new page. Frames that have never been used are
+ * handed out first; after that the CLOCK hand sweeps the pool, giving every
+ * recently referenced frame a second chance before evicting it. Frames holding
+ * changes from the statement in progress stay put until it commits.
+ *
+ * A dirty victim costs a write on the caller's path, so once one turns up
+ * the hand looks a little further for a clean frame, which the flusher keeps
+ * in supply, before settling for it. A dirty victim whose log records are
+ * synced is preferred; for one that is not, the log is synced without the
+ * lock and the caller looks again.
+ *
+ * The victim's page is taken out of the page table, so nobody pins it
+ * again. Returns INVALID_PAGE_NUM when the caller has to look again, as
+ * after waiting with the lock released: another thread may have loaded the
+ * page meanwhile.
+ */
+static uint32_t find_victim_frame(Pager *pager) {
+    uint32_t dirty_victim = INVALID_PAGE_NUM;
+    uint32_t unsynced_victim = INVALID_PAGE_NUM;
+    uint32_t search_end = 2 * pager->num_frames;
+
+    for (uint32_t i = 0; i < search_end; i++) {
+        uint32_t frame_num = pager->clock_hand;
+        Frame *frame = &pager->frames[frame_num];
+        pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+        if (frame->page_num == INVALID_PAGE_NUM) {
+            return frame_num;
+        }
+        if (__atomic_load_n(&frame->pin_count, __ATOMIC_RELAXED) > 0 ||
+            frame->uncommitted || frame->writing) {
+            continue;
+        }
+        if (__atomic_load_n(&frame->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&frame->referenced, false, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (!frame->dirty) {
+            if (page_table_remove(pager, frame)) {
+                return frame_num;
+            }
+            continue;
+        }
+        if (dirty_victim == INVALID_PAGE_NUM &&
+            unsynced_victim == INVALID_PAGE_NUM &&
+            i + PAGER_CLEAN_SEARCH_FRAMES < search_end) {
+            search_end = i + PAGER_CLEAN_SEARCH_FRAMES;
         }
+        if (!frame_synced(pager, frame)) {
+            if (unsynced_victim == INVALID_PAGE_NUM) {
+                unsynced_victim = frame_num;
+            }
+        } else if (dirty_victim == INVALID_PAGE_NUM) {
+            dirty_victim = frame_num;
+        }
+    }
+
+    if (dirty_victim != INVALID_PAGE_NUM) {
+        return page_table_remove(pager, &pager->frames[dirty_victim])
+                   ? dirty_victim
+                   : INVALID_PAGE_NUM;
+    }
+    if (unsynced_victim != INVALID_PAGE_NUM) {
+        sync_wal(pager);
+        return INVALID_PAGE_NUM;
+    }
+
+    // The flusher's frames are clean as soon as its writes land
+    if (pager->flush_in_progress) {
+        wait_for_flusher(pager);
+        return INVALID_PAGE_NUM;
+    }
+
+    if (pager->num_txn_pages > 0) {
+        return add_overflow_frame(pager);
+    }
 
-        if (page_num <= num_pages) {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1) {
-                printf("Error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
+    /*
+     * Other threads hold pins: wait for one to come free, unless every
+     * thread holding pins is itself waiting, for a frame or a latch, and
+     * none would ever be released. Then the pool grows past its budget.
+     * Waiters are counted before looking at the pins again, so a thread
+     * unpinning the last frame after that wakes this one.
+     */
+    bool pinning = thread_pins > 0;
+    uint32_t others =
+        __atomic_load_n(&pager->pinning_threads, __ATOMIC_SEQ_CST) - pinning;
+    if (others == 0) {
+        printf("Buffer pool exhausted: all %d frames are pinned.\n",
+               pager->num_frames);
+        exit(EXIT_FAILURE);
+    }
+
+    __atomic_add_fetch(&pager->frame_waiters, 1, __ATOMIC_SEQ_CST);
+    bool unpinned = false;
+    for (uint32_t i = 0; i < pager->num_frames && !unpinned; i++) {
+        Frame *frame = &pager->frames[i];
+        unpinned = __atomic_load_n(&frame->pin_count, __ATOMIC_SEQ_CST) == 0 &&
+                   !frame->uncommitted && !frame->writing;
+    }
+    uint32_t frame_num = INVALID_PAGE_NUM;
+    if (!unpinned) {
+        if (__atomic_load_n(&pager->blocked_pinners, __ATOMIC_SEQ_CST) <
+            others) {
+            if (pinning) {
+                __atomic_add_fetch(&pager->blocked_pinners, 1, __ATOMIC_SEQ_CST);
             }
+            pthread_cond_wait(&pager->frame_free, &pager->lock);
+            if (pinning) {
+                __atomic_sub_fetch(&pager->blocked_pinners, 1, __ATOMIC_SEQ_CST);
+            }
+        } else {
+            frame_num = add_overflow_frame(pager);
+        }
+    }
+    __atomic_sub_fetch(&pager->frame_waiters, 1, __ATOMIC_SEQ_CST);
+    return frame_num;
+}
+
+/*
+ * Make sure the file covers page_num so the mapping can be touched without
+ * SIGBUS. The file grows in chunks and is trimmed back in pager_close.
+ */
+static void *mmap_get_page(Pager *pager, uint32_t page_num) {
+    uint64_t page_end = ((uint64_t)page_num + 1) * pager->page_size;
+    if (page_end > pager->map_size) {
+        printf("Database exceeds the %llu byte mapping.\n",
+               (unsigned long long)pager->map_size);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Readers check these without the lock; the writer publishes them */
+    if (page_end <= __atomic_load_n(&pager->file_length, __ATOMIC_ACQUIRE) &&
+        page_num < __atomic_load_n(&pager->num_pages, __ATOMIC_ACQUIRE)) {
+        return pager->map + (uint64_t)page_num * pager->page_size;
+    }
+
+    /* Only the writer grows the file, but readers look at its length */
+    pthread_mutex_lock(&pager->lock);
+    if (page_end > pager->file_length) {
+        uint32_t grow_to = page_num + PAGER_MMAP_GROW_PAGES;
+        grow_to -= grow_to % PAGER_MMAP_GROW_PAGES;
+        uint64_t new_length = (uint64_t)grow_to * pager->page_size;
+        if (new_length > pager->map_size) {
+            new_length = pager->map_size;
+        }
+        if (ftruncate(pager->file_descriptor, new_length) == -1) {
+            printf("Error extending file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        __atomic_store_n(&pager->file_length, new_length, __ATOMIC_RELEASE);
+    }
+
+    if (page_num >= pager->num_pages) {
+        __atomic_store_n(&pager->num_pages, page_num + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pager->lock);
+
+    return pager->map + (uint64_t)page_num * pager->page_size;
+}
+
+static void count_pin(Pager *pager) {
+    if (thread_pins++ == 0) {
+        __atomic_add_fetch(&pager->pinning_threads, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/*
+ * Wait, with the lock held, for the thread reading a page into a frame.
+ */
+static void wait_for_load(Pager *pager, uint32_t frame_num) {
+    /* frames may move while the lock is dropped, so index it each time */
+    while (__atomic_load_n(&pager->frames[frame_num].loading,
+                           __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&pager->page_loaded, &pager->lock);
+    }
+}
+
+/*
+ * A resident page is pinned under its stripe's lock alone. On a miss the
+ * lock is taken to claim a frame, which goes into the page table marked
+ * loading before the lock is released to read the file, so other threads
+ * asking for the page wait for this read instead of starting their own.
+ */
+static void *pool_get_page(Pager *pager, uint32_t page_num) {
+    void *data;
+    bool loading;
+    uint32_t frame_num = page_table_pin(pager, page_num, &data, &loading);
+    if (frame_num != INVALID_PAGE_NUM) {
+        count_pin(pager);
+        if (loading) {
+            pthread_mutex_lock(&pager->lock);
+            wait_for_load(pager, frame_num);
+            pthread_mutex_unlock(&pager->lock);
+        }
+        return data;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    uint32_t victim = INVALID_PAGE_NUM;
+    while ((frame_num = page_table_pin(pager, page_num, &data, &loading)) ==
+           INVALID_PAGE_NUM) {
+        victim = find_victim_frame(pager);
+        if (victim != INVALID_PAGE_NUM) {
+            break;
+        }
+    }
+    count_pin(pager);
+    if (frame_num != INVALID_PAGE_NUM) {
+        wait_for_load(pager, frame_num);
+        pthread_mutex_unlock(&pager->lock);
+        return data;
+    }
+
+    // Write back the frame's old page, then load the new one from file
+    Frame *frame = &pager->frames[victim];
+    if (frame->page_num != INVALID_PAGE_NUM && frame->dirty) {
+        write_frame(pager, frame);
+    }
+    frame->page_num = page_num;
+    frame->pin_count = 1;
+    frame->referenced = true;
+    frame->dirty = false;
+    frame->uncommitted = false;
+    frame->loading = true;
+    page_table_insert(pager, page_num, victim);
+
+    uint32_t num_pages = pager->file_length / pager->page_size;
+
+    // We might save a partial page at the end of the file
+    if (pager->file_length % pager->page_size) {
+        num_pages += 1;
+    }
+    if (page_num >= pager->num_pages) {
+        pager->num_pages = page_num + 1;
+    }
+    data = frame->data;
+    pthread_mutex_unlock(&pager->lock);
+
+    memset(data, 0, pager->page_size);
+    if (page_num < num_pages) {
+        ssize_t bytes_read = pread(pager->file_descriptor,
+                                   data,
+                                   pager->page_size,
+                                   (off_t)page_num * pager->page_size);
+        if (bytes_read == -1) {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
         }
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    __atomic_store_n(&pager->frames[victim].loading, false, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pager->page_loaded);
+    pthread_mutex_unlock(&pager->lock);
+    return data;
+}
+
+void *get_page(Pager *pager, uint32_t page_num) {
+    void *page;
+    if (pager->map != NULL) {
+        page = mmap_get_page(pager, page_num);
+    } else {
+        page = pool_get_page(pager, page_num);
+    }
+
+    /* A reader in a snapshot may see an older copy; the page stays pinned */
+    void *shadow = snapshot_page(pager, page_num);
+    return shadow != NULL ? shadow : page;
+}
+
+void unpin_page(Pager *pager, uint32_t page_num) {
+    if (pager->map != NULL) {
+        // Mapped pages are never evicted, so there is nothing to release
+        return;
+    }
+
+    PageTableStripe *stripe = page_table_stripe(pager, page_num);
+    pthread_mutex_lock(&stripe->lock);
+    uint32_t frame_num = stripe_lookup(stripe, page_num);
+    uint32_t pin_count = 0;
+    if (frame_num != INVALID_PAGE_NUM) {
+        pin_count = __atomic_load_n(&pager->frames[frame_num].pin_count,
+                                    __ATOMIC_RELAXED);
+    }
+    if (pin_count == 0) {
+        printf("Tried to unpin page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    bool freed = __atomic_sub_fetch(&pager->frames[frame_num].pin_count,
+                                    1,
+                                    __ATOMIC_SEQ_CST) == 0;
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (--thread_pins == 0) {
+        __atomic_sub_fetch(&pager->pinning_threads, 1, __ATOMIC_SEQ_CST);
+        freed = true;
+    }
+    if (freed && __atomic_load_n(&pager->frame_waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pager->lock);
+        pthread_cond_broadcast(&pager->frame_free);
+        pthread_mutex_unlock(&pager->lock);
+    }
+}
+
+/*
+ * Record that a pinned page was modified so it is written back on eviction or
+ * flush. Pages that were only read are never written.
+ */
+void mark_page_dirty(Pager *pager, uint32_t page_num) {
+    if (pager->map != NULL) {
+        pager->dirty_map[page_num / 8] |= 1 << (page_num % 8);
+        return;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    uint32_t frame_num = page_table_lookup(pager, page_num);
+    if (frame_num == INVALID_PAGE_NUM) {
+        printf("Tried to dirty page %d which is not resident\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    Frame *frame = &pager->frames[frame_num];
+    frame->dirty = true;
+
+    if (pager->wal != NULL && !frame->uncommitted) {
+        frame->uncommitted = true;
+        pager->txn_pages[pager->num_txn_pages++] = page_num;
+    }
+    pthread_mutex_unlock(&pager->lock);
+}
 
-        pager->pages[page_num] = page;
+static LatchBucket *latch_bucket(Pager *pager, uint32_t page_num) {
+    return &pager->latch_buckets[(page_num * 2654435761u) %
+                                 PAGER_LATCH_BUCKETS];
+}
+
+/*
+ * Take the latch of a page, shared for reading or exclusive for changing
+ * it, waiting for holders of the other kind. Does nothing unless latching
+ * is on.
+ */
+void latch_page(Pager *pager, uint32_t page_num, bool exclusive) {
+    if (!pager->latching) {
+        return;
+    }
+
+    LatchBucket *bucket = latch_bucket(pager, page_num);
+    pthread_mutex_lock(&bucket->lock);
+    Latch *latch = bucket->latches;
+    while (latch != NULL && latch->page_num != page_num) {
+        latch = latch->next;
+    }
+    if (latch == NULL) {
+        latch = bucket->free;
+        if (latch != NULL) {
+            bucket->free = latch->next;
+        } else {
+            /*
+             * Every reader passes the root, so a writer waiting there
+             * goes first rather than wait for a gap between readers
+             */
+            pthread_rwlockattr_t attr;
+            pthread_rwlockattr_init(&attr);
+            pthread_rwlockattr_setkind_np(
+                &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+            latch = malloc(sizeof(Latch));
+            pthread_rwlock_init(&latch->rwlock, &attr);
+            pthread_rwlockattr_destroy(&attr);
+        }
+        latch->page_num = page_num;
+        latch->users = 0;
+        latch->next = bucket->latches;
+        bucket->latches = latch;
+    }
+    latch->users++;
+    pthread_mutex_unlock(&bucket->lock);
 
-        if (page_num >= pager->num_pages) {
-            pager->num_pages = page_num + 1;
+    /*
+     * A thread holding pins that waits here cannot release them, so threads
+     * waiting for a frame look again at whether anyone still can
+     */
+    int busy = exclusive ? pthread_rwlock_trywrlock(&latch->rwlock)
+                         : pthread_rwlock_tryrdlock(&latch->rwlock);
+    if (busy && thread_pins > 0) {
+        __atomic_add_fetch(&pager->blocked_pinners, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pager->frame_waiters, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&pager->lock);
+            pthread_cond_broadcast(&pager->frame_free);
+            pthread_mutex_unlock(&pager->lock);
+        }
+    }
+    if (busy) {
+        if (exclusive) {
+            pthread_rwlock_wrlock(&latch->rwlock);
+        } else {
+            pthread_rwlock_rdlock(&latch->rwlock);
+        }
+        if (thread_pins > 0) {
+            __atomic_sub_fetch(&pager->blocked_pinners, 1, __ATOMIC_SEQ_CST);
         }
     }
 
-    return pager->pages[page_num];
+    if (exclusive) {
+        /* Snapshots keep reading the page as it was */
+        void *page = get_page(pager, page_num);
+        shadow_page_save(pager, page_num, page);
+        unpin_page(pager, page_num);
+    }
+}
+
+void unlatch_page(Pager *pager, uint32_t page_num) {
+    if (!pager->latching) {
+        return;
+    }
+
+    LatchBucket *bucket = latch_bucket(pager, page_num);
+    pthread_mutex_lock(&bucket->lock);
+    Latch **link = &bucket->latches;
+    while (*link != NULL && (*link)->page_num != page_num) {
+        link = &(*link)->next;
+    }
+    Latch *latch = *link;
+    if (latch == NULL) {
+        printf("Tried to unlatch page %d which is not latched\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pthread_rwlock_unlock(&latch->rwlock);
+    if (--latch->users == 0) {
+        *link = latch->next;
+        latch->next = bucket->free;
+        bucket->free = latch;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+static uint64_t *page_version_slot(Pager *pager, uint32_t page_num) {
+    return &pager->page_versions[(page_num * 2654435761u) %
+                                 PAGER_VERSION_SLOTS];
+}
+
+/*
+ * The version of a page before reading it without a latch, waiting out a
+ * change in progress. Like latches, versions are only kept while latching
+ * is on.
+ */
+uint64_t page_version(Pager *pager, uint32_t page_num) {
+    if (!pager->latching) {
+        return 0;
+    }
+    uint64_t *slot = page_version_slot(pager, page_num);
+    uint64_t version;
+    while ((version = __atomic_load_n(slot, __ATOMIC_ACQUIRE)) &
+           PAGER_VERSION_CHANGES_MASK) {
+        sched_yield();
+    }
+    return version;
+}
+
+/*
+ * Whether nothing changed a page since page_version returned version, so
+ * what was read from it in between is consistent.
+ */
+bool page_version_valid(Pager *pager, uint32_t page_num, uint64_t version) {
+    if (!pager->latching) {
+        return true;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(page_version_slot(pager, page_num),
+                           __ATOMIC_RELAXED) == version;
 }
 
 /*
-Until we start recycling free pages, new pages will always
-go onto the end of the database file
-*/
+ * Bracket a change to a page that readers may be reading without a latch.
+ * Brackets nest: a split keeps the parent's open while it changes the
+ * children, and pages sharing a slot may be changed at once. Readers wait
+ * until the last one ends.
+ */
+void page_change_begin(Pager *pager, uint32_t page_num) {
+    if (pager->latching) {
+        __atomic_fetch_add(
+            page_version_slot(pager, page_num), 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+void page_change_end(Pager *pager, uint32_t page_num) {
+    if (pager->latching) {
+        /* One change fewer in progress and one more finished */
+        __atomic_fetch_add(page_version_slot(pager, page_num),
+                           PAGER_VERSION_CHANGES_MASK,
+                           __ATOMIC_RELEASE);
+    }
+}
+
+static uint32_t *freelist_trunk_next(void *trunk) {
+    return trunk + FREELIST_TRUNK_NEXT_OFFSET;
+}
+
+static uint32_t *freelist_trunk_num_leaves(void *trunk) {
+    return trunk + FREELIST_TRUNK_NUM_LEAVES_OFFSET;
+}
+
+static uint32_t freelist_trunk_max_leaves(Pager *pager) {
+    return (pager->page_size - FREELIST_TRUNK_HEADER_SIZE) / sizeof(uint32_t);
+}
+
+static uint32_t *freelist_trunk_leaf(void *trunk, uint32_t leaf_num) {
+    return trunk + FREELIST_TRUNK_HEADER_SIZE + leaf_num * sizeof(uint32_t);
+}
+
+/*
+ * Reuse a page from the freelist if there is one, otherwise the page goes
+ * onto the end of the database file. A trunk with no leaves left is handed
+ * out itself. The caller initializes the page; a recycled one holds garbage.
+ */
 uint32_t get_unused_page_num(Pager *pager) {
-    return pager->num_pages;
+    uint32_t trunk_page_num = pager->header.freelist_head;
+    if (trunk_page_num == 0) {
+        return pager->num_pages;
+    }
+
+    uint32_t page_num;
+    void *trunk = get_page(pager, trunk_page_num);
+    uint32_t *num_leaves = freelist_trunk_num_leaves(trunk);
+    if (*num_leaves > 0) {
+        (*num_leaves)--;
+        page_num = *freelist_trunk_leaf(trunk, *num_leaves);
+        mark_page_dirty(pager, trunk_page_num);
+    } else {
+        page_num = trunk_page_num;
+        pager->header.freelist_head = *freelist_trunk_next(trunk);
+    }
+    unpin_page(pager, trunk_page_num);
+    pager->header.freelist_count--;
+    return page_num;
+}
+
+/*
+ * Put a page no longer referenced by the tree on the freelist. It joins the
+ * first trunk while that has room and otherwise becomes the new first trunk.
+ */
+void free_page(Pager *pager, uint32_t page_num) {
+    uint32_t trunk_page_num = pager->header.freelist_head;
+    pager->header.freelist_count++;
+
+    if (trunk_page_num != 0) {
+        void *trunk = get_page(pager, trunk_page_num);
+        uint32_t *num_leaves = freelist_trunk_num_leaves(trunk);
+        if (*num_leaves < freelist_trunk_max_leaves(pager)) {
+            *freelist_trunk_leaf(trunk, *num_leaves) = page_num;
+            (*num_leaves)++;
+            mark_page_dirty(pager, trunk_page_num);
+            unpin_page(pager, trunk_page_num);
+            return;
+        }
+        unpin_page(pager, trunk_page_num);
+    }
+
+    void *new_trunk = get_page(pager, page_num);
+    *freelist_trunk_next(new_trunk) = trunk_page_num;
+    *freelist_trunk_num_leaves(new_trunk) = 0;
+    mark_page_dirty(pager, page_num);
+    unpin_page(pager, page_num);
+    pager->header.freelist_head = page_num;
+}
+
+/*
+ * Empty the freelist and return every page it held, trunks included, in a
+ * malloc'd array. The caller becomes responsible for those pages.
+ */
+uint32_t *pager_drain_freelist(Pager *pager, uint32_t *num_free) {
+    uint32_t *pages =
+        malloc((pager->header.freelist_count + 1) * sizeof(uint32_t));
+    *num_free = 0;
+
+    uint32_t trunk_page_num = pager->header.freelist_head;
+    while (trunk_page_num != 0) {
+        void *trunk = get_page(pager, trunk_page_num);
+        pages[(*num_free)++] = trunk_page_num;
+        for (uint32_t i = 0; i < *freelist_trunk_num_leaves(trunk); i++) {
+            pages[(*num_free)++] = *freelist_trunk_leaf(trunk, i);
+        }
+
+        uint32_t next_page_num = *freelist_trunk_next(trunk);
+        unpin_page(pager, trunk_page_num);
+        trunk_page_num = next_page_num;
+    }
+
+    pager->header.freelist_head = 0;
+    pager->header.freelist_count = 0;
+    return pages;
+}
+
+static int compare_page_table_entries(const void *a, const void *b) {
+    uint32_t page_a = ((const PageTableEntry *)a)->page_num;
+    uint32_t page_b = ((const PageTableEntry *)b)->page_num;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+/*
+ * Write up to max_pages dirty frames, starting at the CLOCK hand so the
+ * frames it reaches next are the ones made clean. Only unpinned, committed
+ * frames whose log records are durable qualify. Their contents are copied
+ * under the lock and written in coalesced runs without it. A batch takes at
+ * most a quarter of the pool so eviction always has frames to choose from.
+ */
+static void flusher_write_pages(Pager *pager,
+                                uint32_t max_pages,
+                                PageTableEntry *batch,
+                                void *buffer) {
+    if (max_pages > pager->cache_pages / 4) {
+        max_pages = pager->cache_pages / 4;
+    }
+
+    uint32_t num_batch = 0;
+    for (uint32_t i = 0; i < pager->num_frames && num_batch < max_pages; i++) {
+        uint32_t frame_num = (pager->clock_hand + i) % pager->num_frames;
+        Frame *frame = &pager->frames[frame_num];
+        if (frame->page_num == INVALID_PAGE_NUM || !frame->dirty ||
+            __atomic_load_n(&frame->pin_count, __ATOMIC_RELAXED) > 0 ||
+            frame->uncommitted || frame->writing) {
+            continue;
+        }
+        if (!frame_synced(pager, frame)) {
+            continue;
+        }
+        batch[num_batch].page_num = frame->page_num;
+        batch[num_batch].frame_num = frame_num;
+        num_batch++;
+    }
+    if (num_batch == 0) {
+        return;
+    }
+
+    qsort(batch, num_batch, sizeof(PageTableEntry), compare_page_table_entries);
+
+    /*
+     * Readers pin pages without the lock, so each page is copied under its
+     * stripe's lock, where nobody can pin it and start changing it
+     */
+    uint32_t num_copied = 0;
+    for (uint32_t i = 0; i < num_batch; i++) {
+        Frame *frame = &pager->frames[batch[i].frame_num];
+        PageTableStripe *stripe = page_table_stripe(pager, frame->page_num);
+        pthread_mutex_lock(&stripe->lock);
+        if (__atomic_load_n(&frame->pin_count, __ATOMIC_RELAXED) == 0) {
+            memcpy(buffer + (size_t)num_copied * pager->page_size,
+                   frame->data,
+                   pager->page_size);
+            frame->writing = true;
+            frame->dirty = false;
+            batch[num_copied++] = batch[i];
+        }
+        pthread_mutex_unlock(&stripe->lock);
+    }
+    num_batch = num_copied;
+    pager->flush_in_progress = true;
+    pthread_mutex_unlock(&pager->lock);
+
+    struct iovec iov[PAGER_FLUSH_BATCH_PAGES];
+    off_t end = 0;
+    uint32_t i = 0;
+    while (i < num_batch) {
+        uint32_t run_start = batch[i].page_num;
+        int iovcnt = 0;
+        while (i < num_batch && batch[i].page_num == run_start + iovcnt) {
+            iov[iovcnt].iov_base = buffer + (size_t)i * pager->page_size;
+            iov[iovcnt].iov_len = pager->page_size;
+            iovcnt++;
+            i++;
+        }
+        off_t run_end =
+            write_run(pager->file_descriptor, pager->page_size, run_start, iov,
+                      iovcnt);
+        if (run_end > end) {
+            end = run_end;
+        }
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    for (i = 0; i < num_batch; i++) {
+        Frame *frame = &pager->frames[batch[i].frame_num];
+        frame->writing = false;
+        if (frame->checkpoint) {
+            frame->checkpoint = false;
+            pager->checkpoint_pages--;
+        }
+    }
+    if ((uint64_t)end > pager->file_length) {
+        pager->file_length = end;
+    }
+    pager->flush_in_progress = false;
+    pthread_cond_broadcast(&pager->write_done);
+}
+
+/*
+ * Start an incremental checkpoint: retire the full log and note which
+ * resident pages still have to reach the database file for it. Pages that
+ * are already clean were written before the log was retired.
+ */
+static void flusher_begin_checkpoint(Pager *pager) {
+    /* Commits may land while the lock is released for the sync */
+    while (pager->wal->synced_seq != pager->wal->commit_seq) {
+        sync_wal(pager);
+    }
+    wal_retire(pager->wal);
+
+    pager->checkpointing = true;
+    pager->checkpoint_pages = 0;
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+        Frame *frame = &pager->frames[i];
+        if (frame->page_num != INVALID_PAGE_NUM && frame->dirty) {
+            frame->checkpoint = true;
+            pager->checkpoint_pages++;
+        }
+    }
+}
+
+static void flusher_end_checkpoint(Pager *pager) {
+    int fd = pager->file_descriptor;
+    pthread_mutex_unlock(&pager->lock);
+    if (fdatasync(fd) == -1) {
+        printf("Error syncing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&pager->lock);
+    wal_retire_done(pager->wal);
+    pager->checkpointing = false;
+}
+
+/*
+ * Every tick the flusher syncs outstanding commits, then spends the write
+ * budget accrued at flush_rate pages per second. Commits that fill a group
+ * wake it early. With a flush rate of 0 it only syncs, so a group that never
+ * fills is still durable within a tick, and checkpoints stay with the
+ * statements.
+ */
+static void *flusher_main(void *arg) {
+    Pager *pager = arg;
+    PageTableEntry *batch =
+        malloc(PAGER_FLUSH_BATCH_PAGES * sizeof(PageTableEntry));
+    void *buffer = malloc((size_t)PAGER_FLUSH_BATCH_PAGES * pager->page_size);
+    uint64_t credit = 0;
+    uint64_t last_usec = now_usec();
+
+    pthread_mutex_lock(&pager->lock);
+    while (!pager->flusher_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += PAGER_FLUSH_TICK_USEC * 1000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        /* A statement waiting for its commit to be synced goes first */
+        if (pager->sync_waiters == 0 || pager->wal == NULL ||
+            pager->wal->synced_seq == pager->wal->commit_seq) {
+            pthread_cond_timedwait(
+                &pager->flusher_wake, &pager->lock, &deadline);
+        }
+        if (pager->flusher_stop) {
+            break;
+        }
+
+        uint64_t now = now_usec();
+        credit += (now - last_usec) * pager->flush_rate;
+        if (credit > (uint64_t)PAGER_FLUSH_BATCH_PAGES * 1000000) {
+            credit = (uint64_t)PAGER_FLUSH_BATCH_PAGES * 1000000;
+        }
+        last_usec = now;
+
+        sync_wal(pager);
+        if (pager->flush_rate == 0) {
+            continue;
+        }
+        if (pager->wal != NULL && !pager->checkpointing &&
+            wal_needs_checkpoint(pager->wal)) {
+            flusher_begin_checkpoint(pager);
+        }
+
+        uint32_t budget = credit / 1000000;
+        if (budget > 0) {
+            credit -= (uint64_t)budget * 1000000;
+            flusher_write_pages(pager, budget, batch, buffer);
+        }
+
+        if (pager->checkpointing && pager->checkpoint_pages == 0) {
+            flusher_end_checkpoint(pager);
+        }
+    }
+    pthread_mutex_unlock(&pager->lock);
+
+    free(batch);
+    free(buffer);
+    return NULL;
+}
+
+static void start_flusher(Pager *pager) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pager->flusher_wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pager->flusher_stop = false;
+    if (pthread_create(&pager->flusher, NULL, flusher_main, pager) != 0) {
+        printf("Unable to start flusher thread\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->flusher_running = true;
+}
+
+static void stop_flusher(Pager *pager) {
+    pthread_mutex_lock(&pager->lock);
+    pager->flusher_stop = true;
+    pthread_cond_signal(&pager->flusher_wake);
+    pthread_mutex_unlock(&pager->lock);
+
+    pthread_join(pager->flusher, NULL);
+    pthread_cond_destroy(&pager->flusher_wake);
+    pager->flusher_running = false;
+}
+
+static uint64_t header_checksum(void *header) {
+    return fletcher_checksum(0, header, DB_HEADER_CHECKSUM_OFFSET);
+}
+
+static bool valid_page_size(uint32_t page_size) {
+    return page_size >= PAGER_MIN_PAGE_SIZE &&
+           page_size <= PAGER_MAX_PAGE_SIZE &&
+           (page_size & (page_size - 1)) == 0;
+}
+
+/*
+ * Load the metadata from the header page. It is read straight from the file,
+ * before any frames exist, because the page size it records decides how big
+ * they are. A new file takes the page size from the options and gets an empty
+ * header, written by its first commit. Files without a valid header, from
+ * another format version or with a different key width are refused rather
+ * than guessed at.
+ */
+static void header_read(Pager *pager, const DbOptions *options) {
+    memset(&pager->header, 0, sizeof(DbHeader));
+    if (pager->file_length == 0) {
+        if (!valid_page_size(options->page_size)) {
+            printf("Page size must be a power of two from %d to %d.\n",
+                   PAGER_MIN_PAGE_SIZE,
+                   PAGER_MAX_PAGE_SIZE);
+            exit(EXIT_FAILURE);
+        }
+        pager->page_size = options->page_size;
+        pager->num_pages = 1;
+        return;
+    }
+
+    uint8_t header[DB_HEADER_SIZE];
+    ssize_t bytes_read =
+        pread(pager->file_descriptor, header, DB_HEADER_SIZE, 0);
+    if (bytes_read == -1) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    if (bytes_read != DB_HEADER_SIZE ||
+        memcmp(header + DB_HEADER_MAGIC_OFFSET,
+               DB_HEADER_MAGIC,
+               DB_HEADER_MAGIC_SIZE) != 0) {
+        printf("File is not a database or has no header.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t version = *(uint32_t *)(header + DB_HEADER_VERSION_OFFSET);
+    if (version != DB_FORMAT_VERSION) {
+        printf("Database format version %d is not supported (expected %d).\n",
+               version,
+               DB_FORMAT_VERSION);
+        exit(EXIT_FAILURE);
+    }
+
+    if (*(uint64_t *)(header + DB_HEADER_CHECKSUM_OFFSET) !=
+        header_checksum(header)) {
+        printf("Database header is corrupt.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t page_size = *(uint32_t *)(header + DB_HEADER_PAGE_SIZE_OFFSET);
+    if (!valid_page_size(page_size)) {
+        printf("Database page size %d is not supported.\n", page_size);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t key_size = *(uint32_t *)(header + DB_HEADER_KEY_SIZE_OFFSET);
+    if (key_size != sizeof(Key)) {
+        printf("Database has %d-bit keys but this build uses %d-bit keys.\n",
+               key_size * 8,
+               KEY_BITS);
+        exit(EXIT_FAILURE);
+    }
+
+    pager->page_size = page_size;
+    pager->num_pages = *(uint32_t *)(header + DB_HEADER_NUM_PAGES_OFFSET);
+    pager->header.root_page_num =
+        *(uint32_t *)(header + DB_HEADER_ROOT_PAGE_OFFSET);
+    pager->header.freelist_head =
+        *(uint32_t *)(header + DB_HEADER_FREELIST_HEAD_OFFSET);
+    pager->header.freelist_count =
+        *(uint32_t *)(header + DB_HEADER_FREELIST_COUNT_OFFSET);
+    pager->header.row_count =
+        *(uint64_t *)(header + DB_HEADER_ROW_COUNT_OFFSET);
+    memcpy(pager->header.index_root_page_nums,
+           header + DB_HEADER_INDEX_ROOTS_OFFSET,
+           sizeof(pager->header.index_root_page_nums));
+}
+
+/*
+ * Copy the metadata into the header page if any of it changed, so the change
+ * commits with the statement that made it.
+ */
+static void header_write(Pager *pager) {
+    uint8_t header[DB_HEADER_SIZE];
+    memset(header, 0, DB_HEADER_SIZE);
+    memcpy(header + DB_HEADER_MAGIC_OFFSET, DB_HEADER_MAGIC, DB_HEADER_MAGIC_SIZE);
+    *(uint32_t *)(header + DB_HEADER_VERSION_OFFSET) = DB_FORMAT_VERSION;
+    *(uint32_t *)(header + DB_HEADER_PAGE_SIZE_OFFSET) = pager->page_size;
+    *(uint32_t *)(header + DB_HEADER_NUM_PAGES_OFFSET) = pager->num_pages;
+    *(uint32_t *)(header + DB_HEADER_ROOT_PAGE_OFFSET) =
+        pager->header.root_page_num;
+    *(uint32_t *)(header + DB_HEADER_FREELIST_HEAD_OFFSET) =
+        pager->header.freelist_head;
+    *(uint32_t *)(header + DB_HEADER_FREELIST_COUNT_OFFSET) =
+        pager->header.freelist_count;
+    *(uint64_t *)(header + DB_HEADER_ROW_COUNT_OFFSET) =
+        pager->header.row_count;
+    *(uint32_t *)(header + DB_HEADER_KEY_SIZE_OFFSET) = sizeof(Key);
+    memcpy(header + DB_HEADER_INDEX_ROOTS_OFFSET,
+           pager->header.index_root_page_nums,
+           sizeof(pager->header.index_root_page_nums));
+    *(uint64_t *)(header + DB_HEADER_CHECKSUM_OFFSET) = header_checksum(header);
+
+    void *page = get_page(pager, DB_HEADER_PAGE);
+    if (memcmp(page, header, DB_HEADER_SIZE) != 0) {
+        memcpy(page, header, DB_HEADER_SIZE);
+        mark_page_dirty(pager, DB_HEADER_PAGE);
+    }
+    unpin_page(pager, DB_HEADER_PAGE);
 }
 
-Pager *pager_open(const char *filename) {
+Pager *pager_open(const char *filename, const DbOptions *options) {
     int fd = open(filename,
                   O_RDWR | // Read/Write mode
                       O_CREAT, // Create file if it does not exist
@@ -58,44 +1308,404 @@ Pager *pager_open(const char *filename) {
         exit(EXIT_FAILURE);
     }
 
+    wal_recover(filename, fd);
+
     off_t file_length = lseek(fd, 0, SEEK_END);
 
     Pager *pager = malloc(sizeof(Pager));
     pager->file_descriptor = fd;
     pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
+    header_read(pager, options);
 
-    if (file_length % PAGE_SIZE != 0) {
-        printf("Db file is not a whole number of pages. Corrupt file.\n");
-        exit(EXIT_FAILURE);
+    pager->map = NULL;
+    pager->map_size = 0;
+    pager->dirty_map = NULL;
+    pager->wal = NULL;
+    pager->txn_pages = NULL;
+    pager->num_txn_pages = 0;
+    pthread_mutex_init(&pager->lock, NULL);
+    pthread_cond_init(&pager->write_done, NULL);
+    pthread_cond_init(&pager->wal_synced, NULL);
+    pager->sync_waiters = 0;
+    pager->async_commit = options->async_commit;
+    pager->flusher_running = false;
+    pager->flush_in_progress = false;
+    pager->flush_rate = options->flush_rate;
+    pager->checkpointing = false;
+    pager->checkpoint_pages = 0;
+    pthread_cond_init(&pager->frame_free, NULL);
+    pthread_cond_init(&pager->page_loaded, NULL);
+    pager->frame_waiters = 0;
+    pager->pinning_threads = 0;
+    pager->blocked_pinners = 0;
+    pager->latching = options->concurrent_readers;
+    for (uint32_t i = 0; i < PAGER_LATCH_BUCKETS; i++) {
+        pthread_mutex_init(&pager->latch_buckets[i].lock, NULL);
+        pager->latch_buckets[i].latches = NULL;
+        pager->latch_buckets[i].free = NULL;
+    }
+    memset(pager->page_versions, 0, sizeof(pager->page_versions));
+    pager->snapshot_seq = 0;
+    pager->num_shadow_pages = 0;
+    pthread_mutex_init(&pager->shadow_lock, NULL);
+    for (uint32_t i = 0; i < PAGER_SHADOW_BUCKETS; i++) {
+        pthread_mutex_init(&pager->shadow_buckets[i].lock, NULL);
+        pager->shadow_buckets[i].pages = NULL;
+    }
+    pager->snapshots = NULL;
+    if (options->use_mmap) {
+        pager->map = mmap(NULL,
+                          options->mmap_size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED,
+                          fd,
+                          0);
+        if (pager->map == MAP_FAILED) {
+            printf("Unable to map file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->map_size = options->mmap_size;
+        pager->dirty_map = calloc(pager->map_size / pager->page_size / 8 + 1, 1);
+        pager->cache_pages = 0;
+        pager->num_frames = 0;
+        pager->frames_capacity = 0;
+        pager->frames = NULL;
+        pager->frame_data = NULL;
+        page_table_init(pager);
+        pager->clock_hand = 0;
+        return pager;
+    }
+
+    pager->cache_pages = options->cache_pages;
+    if (pager->cache_pages < PAGER_MIN_CACHE_PAGES) {
+        pager->cache_pages = PAGER_MIN_CACHE_PAGES;
+    }
+    pager->num_frames = pager->cache_pages;
+    pager->frames_capacity = pager->cache_pages;
+    pager->frame_data = malloc((size_t)pager->num_frames * pager->page_size);
+    pager->frames = malloc(pager->num_frames * sizeof(Frame));
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+        init_frame(&pager->frames[i],
+                   pager->frame_data + (size_t)i * pager->page_size);
+    }
+    pager->clock_hand = 0;
+    page_table_init(pager);
+
+    /*
+  Writes through the mapping reach the file directly, so only the buffered
+  pager can hold changes back until the log covers them
+  */
+    if (options->use_wal) {
+        pager->wal =
+            wal_open(filename, options->wal_group_commits, pager->page_size);
+        pager->txn_pages = malloc(pager->num_frames * sizeof(uint32_t));
     }
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+    if (pager->flush_rate > 0 || pager->wal != NULL) {
+        start_flusher(pager);
     }
 
     return pager;
 }
 
 void pager_flush(Pager *pager, uint32_t page_num) {
-    if (pager->pages[page_num] == NULL) {
-        printf("Tried to flush null page\n");
+    if (pager->map != NULL) {
+        void *page = pager->map + (uint64_t)page_num * pager->page_size;
+        if (msync(page, pager->page_size, MS_SYNC) == -1) {
+            printf("Error syncing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->dirty_map[page_num / 8] &= ~(1 << (page_num % 8));
+        return;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    sync_wal(pager);
+    wait_for_flusher(pager);
+    uint32_t frame_num = page_table_lookup(pager, page_num);
+    if (frame_num == INVALID_PAGE_NUM) {
+        printf("Tried to flush page %d which is not resident\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+
+    write_frame(pager, &pager->frames[frame_num]);
+    pthread_mutex_unlock(&pager->lock);
+}
+
+static bool mmap_page_dirty(Pager *pager, uint32_t page_num) {
+    return pager->dirty_map[page_num / 8] & (1 << (page_num % 8));
+}
+
+/*
+ * msync each run of adjacent dirty pages as a single range.
+ */
+static void mmap_flush_all(Pager *pager) {
+    uint32_t page_num = 0;
+    while (page_num < pager->num_pages) {
+        if (!mmap_page_dirty(pager, page_num)) {
+            page_num++;
+            continue;
+        }
+
+        uint32_t run_start = page_num;
+        while (page_num < pager->num_pages && mmap_page_dirty(pager, page_num)) {
+            pager->dirty_map[page_num / 8] &= ~(1 << (page_num % 8));
+            page_num++;
+        }
+
+        void *start = pager->map + (uint64_t)run_start * pager->page_size;
+        uint64_t length = (uint64_t)(page_num - run_start) * pager->page_size;
+        if (msync(start, length, MS_SYNC) == -1) {
+            printf("Error syncing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Write back every dirty page. Dirty pages are sorted by page number and each
+ * run of adjacent pages goes out in one pwritev, so the cost tracks the amount
+ * of modified data rather than the size of the cache.
+ */
+static void flush_all(Pager *pager) {
+    sync_wal(pager);
+    wait_for_flusher(pager);
+
+    PageTableEntry *dirty = malloc(pager->num_frames * sizeof(PageTableEntry));
+    uint32_t num_dirty = 0;
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+        if (pager->frames[i].page_num != INVALID_PAGE_NUM &&
+            pager->frames[i].dirty) {
+            dirty[num_dirty].page_num = pager->frames[i].page_num;
+            dirty[num_dirty].frame_num = i;
+            num_dirty++;
+        }
+    }
+    qsort(dirty, num_dirty, sizeof(PageTableEntry), compare_page_table_entries);
+
+    struct iovec iov[IOV_MAX];
+    uint32_t i = 0;
+    while (i < num_dirty) {
+        uint32_t run_start = dirty[i].page_num;
+        int iovcnt = 0;
+        while (i < num_dirty && iovcnt < IOV_MAX &&
+               dirty[i].page_num == run_start + iovcnt) {
+            Frame *frame = &pager->frames[dirty[i].frame_num];
+            iov[iovcnt].iov_base = frame->data;
+            iov[iovcnt].iov_len = pager->page_size;
+            frame_written(pager, frame);
+            iovcnt++;
+            i++;
+        }
+        write_pages(pager, run_start, iov, iovcnt);
+    }
+
+    free(dirty);
+}
+
+void pager_flush_all(Pager *pager) {
+    if (pager->map != NULL) {
+        mmap_flush_all(pager);
+        return;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    flush_all(pager);
+    pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+ * Copy everything the log covers into the database file, make it durable and
+ * start a new log. This is the synchronous path used when there is no flusher
+ * and on close; it also completes a checkpoint the flusher left unfinished.
+ */
+static void checkpoint(Pager *pager) {
+    if (pager->map != NULL) {
+        mmap_flush_all(pager);
+        return;
+    }
+
+    flush_all(pager);
+    if (pager->wal == NULL) {
+        return;
+    }
+
+    if (fdatasync(pager->file_descriptor) == -1) {
+        printf("Error syncing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    wal_reset(pager->wal);
+    pager->checkpointing = false;
+}
+
+/*
+ * Log every page the current statement modified, including the header page
+ * if the metadata changed. Afterwards those pages are
+ * ordinary dirty pages that may be written once the log has been synced. The
+ * sync happens on the flusher's thread, and the statement waits for it
+ * unless commits are asynchronous. Checkpoints run there too unless the
+ * flush rate is 0.
+ */
+void pager_commit(Pager *pager) {
+    snapshot_commit(pager);
+    header_write(pager);
+    if (pager->wal == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    if (pager->num_txn_pages == 0) {
+        pthread_mutex_unlock(&pager->lock);
+        return;
+    }
+
+    void **pages = malloc(pager->num_txn_pages * sizeof(void *));
+    for (uint32_t i = 0; i < pager->num_txn_pages; i++) {
+        uint32_t frame_num = page_table_lookup(pager, pager->txn_pages[i]);
+        pages[i] = pager->frames[frame_num].data;
+    }
+    uint64_t commit_seq = wal_commit(pager->wal,
+                                     pager->num_txn_pages,
+                                     pager->txn_pages,
+                                     pages,
+                                     pager->num_pages);
+    for (uint32_t i = 0; i < pager->num_txn_pages; i++) {
+        uint32_t frame_num = page_table_lookup(pager, pager->txn_pages[i]);
+        pager->frames[frame_num].uncommitted = false;
+        pager->frames[frame_num].commit_seq = commit_seq;
+    }
+    free(pages);
+    pager->num_txn_pages = 0;
+    release_overflow_frames(pager);
+
+    if (!pager->flusher_running) {
+        if (!pager->async_commit || wal_sync_due(pager->wal)) {
+            wal_sync(pager->wal);
+        }
+    } else if (!pager->async_commit) {
+        /*
+      The statement is not done until its commit is durable. The flusher
+      syncs it on its thread, so the wait leaves the lock to readers.
+      */
+        pager->sync_waiters++;
+        pthread_cond_signal(&pager->flusher_wake);
+        while (pager->wal->synced_seq < commit_seq) {
+            pthread_cond_wait(&pager->wal_synced, &pager->lock);
+        }
+        pager->sync_waiters--;
+    } else if (wal_sync_due(pager->wal)) {
+        pthread_cond_signal(&pager->flusher_wake);
+    }
+    if (pager->flush_rate == 0 && wal_needs_checkpoint(pager->wal)) {
+        checkpoint(pager);
+    }
+    pthread_mutex_unlock(&pager->lock);
+}
+
+void pager_checkpoint(Pager *pager) {
+    pthread_mutex_lock(&pager->lock);
+    checkpoint(pager);
+    pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+ * Cut the database file down to its first num_pages pages, none of which may
+ * be referenced any more. The new size commits with the current statement,
+ * then everything is checkpointed so neither the log nor a later write-back
+ * can bring the dropped pages back.
+ */
+void pager_truncate(Pager *pager, uint32_t num_pages) {
+    __atomic_store_n(&pager->num_pages, num_pages, __ATOMIC_RELEASE);
+    pager_commit(pager);
+
+    if (pager->map != NULL) {
+        // mmap_close trims the file to num_pages
+        mmap_flush_all(pager);
+        return;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    checkpoint(pager);
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+        Frame *frame = &pager->frames[i];
+        if (frame->page_num == INVALID_PAGE_NUM || frame->page_num < num_pages) {
+            continue;
+        }
+        if (!page_table_remove(pager, frame)) {
+            printf("Tried to truncate pinned page %d\n", frame->page_num);
+            exit(EXIT_FAILURE);
+        }
+        frame->page_num = INVALID_PAGE_NUM;
+        frame->referenced = false;
+    }
+
+    uint64_t length = (uint64_t)num_pages * pager->page_size;
+    if (ftruncate(pager->file_descriptor, length) == -1) {
+        printf("Error truncating file: %d\n", errno);
         exit(EXIT_FAILURE);
     }
+    pager->file_length = length;
+    pthread_mutex_unlock(&pager->lock);
+}
 
-    off_t offset =
-        lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+static void mmap_close(Pager *pager) {
+    munmap(pager->map, pager->map_size);
 
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
+    // Drop the unused tail left over from growing the file in chunks
+    uint64_t used_length = (uint64_t)pager->num_pages * pager->page_size;
+    if (ftruncate(pager->file_descriptor, used_length) == -1) {
+        printf("Error truncating file: %d\n", errno);
         exit(EXIT_FAILURE);
     }
+    free(pager->dirty_map);
+}
 
-    ssize_t bytes_written =
-        write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+void pager_close(Pager *pager) {
+    if (pager->flusher_running) {
+        stop_flusher(pager);
+    }
+    pager_commit(pager);
+    pager_checkpoint(pager);
+    if (pager->wal != NULL) {
+        wal_close(pager->wal);
+    }
 
-    if (bytes_written == -1) {
-        printf("Error writing: %d\n", errno);
+    if (pager->map != NULL) {
+        mmap_close(pager);
+    }
+
+    int result = close(pager->file_descriptor);
+    if (result == -1) {
+        printf("Error closing db file.\n");
         exit(EXIT_FAILURE);
     }
+
+    for (uint32_t i = pager->cache_pages; i < pager->num_frames; i++) {
+        free(pager->frames[i].data);
+    }
+    free(pager->txn_pages);
+    page_table_free(pager);
+    free(pager->frames);
+    free(pager->frame_data);
+    for (uint32_t i = 0; i < PAGER_LATCH_BUCKETS; i++) {
+        LatchBucket *bucket = &pager->latch_buckets[i];
+        while (bucket->free != NULL) {
+            Latch *latch = bucket->free;
+            bucket->free = latch->next;
+            pthread_rwlock_destroy(&latch->rwlock);
+            free(latch);
+        }
+        pthread_mutex_destroy(&bucket->lock);
+    }
+    shadow_pages_free(pager);
+    for (uint32_t i = 0; i < PAGER_SHADOW_BUCKETS; i++) {
+        pthread_mutex_destroy(&pager->shadow_buckets[i].lock);
+    }
+    pthread_mutex_destroy(&pager->shadow_lock);
+    pthread_cond_destroy(&pager->write_done);
+    pthread_cond_destroy(&pager->wal_synced);
+    pthread_cond_destroy(&pager->frame_free);
+    pthread_cond_destroy(&pager->page_loaded);
+    pthread_mutex_destroy(&pager->lock);
+    free(pager);
 }
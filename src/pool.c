@@ -0,0 +1,340 @@
+#include "pool.h"
+
+/*
+ * A work-stealing pool of worker threads shared by everything that splits
+ * work into tasks, so that work never runs on more threads than the pool
+ * has. Each worker keeps a deque of tasks: it pushes and pops at the
+ * bottom, and idle workers steal from the top without taking a lock.
+ * Tasks submitted from outside the pool go to a shared queue, from which a
+ * worker takes one task and moves a share of the rest into its deque for
+ * the others to steal. A thread waiting for its tasks runs them too, so
+ * the pool's threads and the waiting one are the threads a query uses.
+ * A task may submit tasks and wait for them: those stay on its thread
+ * unless stolen, and waiting inside a task only runs them, which bounds how
+ * deep waits nest.
+ */
+
+typedef struct Task {
+    TaskFunction function;
+    void *arg;
+    TaskGroup *group;
+    /* The next task in the shared queue */
+    struct Task *next;
+} Task;
+
+/*
+ * A Chase-Lev deque of a fixed size. Only its worker touches the bottom.
+ */
+typedef struct {
+    int64_t top;
+    int64_t bottom;
+    Task *tasks[POOL_DEQUE_SIZE];
+} TaskDeque;
+
+typedef struct {
+    TaskPool *pool;
+    uint32_t index;
+    pthread_t thread;
+    TaskDeque deque;
+} PoolWorker;
+
+struct TaskPool {
+    uint32_t num_workers;
+    PoolWorker *workers;
+    /* lock guards the shared queue, stop and the waits on wake */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    Task *queue_head;
+    Task *queue_tail;
+    uint64_t queue_length;
+    /* Tasks submitted and not yet taken, in the queue or in deques */
+    uint64_t num_queued;
+    bool stop;
+};
+
+/* The worker running on the calling thread, if it is one */
+static __thread PoolWorker *current_worker;
+/* How many tasks the calling thread is running, one inside another */
+static __thread uint32_t task_depth;
+
+static bool deque_push(TaskDeque *deque, Task *task) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= POOL_DEQUE_SIZE) {
+        return false;
+    }
+    __atomic_store_n(
+        &deque->tasks[bottom % POOL_DEQUE_SIZE], task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static Task *deque_pop(TaskDeque *deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    Task *task = NULL;
+    if (top <= bottom) {
+        task = __atomic_load_n(
+            &deque->tasks[bottom % POOL_DEQUE_SIZE], __ATOMIC_RELAXED);
+        if (top == bottom) {
+            /* The last task: a thief may be taking it too */
+            if (!__atomic_compare_exchange_n(&deque->top,
+                                             &top,
+                                             top + 1,
+                                             false,
+                                             __ATOMIC_SEQ_CST,
+                                             __ATOMIC_RELAXED)) {
+                task = NULL;
+            }
+            __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/*
+ * Take the task at the top of another worker's deque. Returns NULL if it is
+ * empty or another thread took the task first.
+ */
+static Task *deque_steal(TaskDeque *deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return NULL;
+    }
+    Task *task = __atomic_load_n(
+        &deque->tasks[top % POOL_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top,
+                                     &top,
+                                     top + 1,
+                                     false,
+                                     __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return task;
+}
+
+static Task *queue_take(TaskPool *pool) {
+    Task *task = pool->queue_head;
+    if (task != NULL) {
+        pool->queue_head = task->next;
+        if (pool->queue_head == NULL) {
+            pool->queue_tail = NULL;
+        }
+        __atomic_store_n(
+            &pool->queue_length, pool->queue_length - 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/*
+ * The next task for a thread to run: from its own deque, then the shared
+ * queue, then stolen from the other workers. worker is NULL for a thread
+ * outside the pool.
+ */
+static Task *take_task(TaskPool *pool, PoolWorker *worker) {
+    Task *task = worker != NULL ? deque_pop(&worker->deque) : NULL;
+
+    if (task == NULL &&
+        __atomic_load_n(&pool->queue_length, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        task = queue_take(pool);
+        if (task != NULL && worker != NULL) {
+            /* Take a share of the rest, for idle workers to steal */
+            uint64_t share = pool->queue_length / pool->num_workers;
+            for (uint64_t i = 0; i < share; i++) {
+                Task *next = pool->queue_head;
+                if (!deque_push(&worker->deque, next)) {
+                    break;
+                }
+                queue_take(pool);
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    uint32_t start = worker != NULL ? worker->index + 1 : 0;
+    for (uint32_t i = 0; task == NULL && i < pool->num_workers; i++) {
+        PoolWorker *victim = &pool->workers[(start + i) % pool->num_workers];
+        if (victim != worker) {
+            task = deque_steal(&victim->deque);
+        }
+    }
+
+    if (task != NULL) {
+        __atomic_sub_fetch(&pool->num_queued, 1, __ATOMIC_ACQ_REL);
+    }
+    return task;
+}
+
+static void run_task(TaskPool *pool, Task *task) {
+    TaskGroup *group = task->group;
+    task_depth++;
+    task->function(task->arg);
+    task_depth--;
+    free(task);
+    if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void *worker_main(void *arg) {
+    PoolWorker *worker = arg;
+    TaskPool *pool = worker->pool;
+    current_worker = worker;
+
+    while (true) {
+        Task *task = take_task(pool, worker);
+        if (task != NULL) {
+            run_task(pool, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop &&
+               __atomic_load_n(&pool->num_queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        bool done = pool->stop &&
+                    __atomic_load_n(&pool->num_queued, __ATOMIC_ACQUIRE) == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (done) {
+            break;
+        }
+        /* Another thread may be taking the task that woke this one */
+        sched_yield();
+    }
+    return NULL;
+}
+
+/*
+ * A pool of num_workers threads. With none, tasks run on the thread that
+ * waits for them.
+ */
+TaskPool *pool_create(uint32_t num_workers) {
+    TaskPool *pool = calloc(1, sizeof(TaskPool));
+    pool->num_workers = num_workers;
+    pool->workers = calloc(num_workers, sizeof(PoolWorker));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (uint32_t i = 0; i < num_workers; i++) {
+        PoolWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            printf("Unable to start pool thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return pool;
+}
+
+/*
+ * Run the tasks still queued, then stop the workers.
+ */
+void pool_destroy(TaskPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+/*
+ * The threads that run a query's tasks: the workers and the one waiting.
+ */
+uint32_t pool_num_threads(TaskPool *pool) {
+    return pool->num_workers + 1;
+}
+
+/*
+ * Queue function(arg) as part of group. A task submitted by a worker goes
+ * into its own deque and others into the shared queue, but one submitted
+ * from inside a task that has nowhere to wait for a thief, as when the
+ * deque is full or the task runs outside the pool, runs right away.
+ */
+void pool_submit(TaskPool *pool,
+                 TaskGroup *group,
+                 TaskFunction function,
+                 void *arg) {
+    Task *task = malloc(sizeof(Task));
+    task->function = function;
+    task->arg = arg;
+    task->group = group;
+    task->next = NULL;
+    __atomic_add_fetch(&group->pending, 1, __ATOMIC_ACQ_REL);
+
+    /* Counted before it can be taken, and before the wakeup */
+    __atomic_add_fetch(&pool->num_queued, 1, __ATOMIC_ACQ_REL);
+
+    PoolWorker *worker = current_worker;
+    bool pushed = worker != NULL && worker->pool == pool &&
+                  deque_push(&worker->deque, task);
+    if (!pushed && (worker != NULL || task_depth > 0)) {
+        __atomic_sub_fetch(&pool->num_queued, 1, __ATOMIC_ACQ_REL);
+        run_task(pool, task);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (!pushed) {
+        if (pool->queue_tail != NULL) {
+            pool->queue_tail->next = task;
+        } else {
+            pool->queue_head = task;
+        }
+        pool->queue_tail = task;
+        __atomic_store_n(
+            &pool->queue_length, pool->queue_length + 1, __ATOMIC_RELAXED);
+    }
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Wait until every task of group has run, running queued tasks meanwhile;
+ * inside a task, only those left in the worker's own deque.
+ */
+void pool_wait(TaskPool *pool, TaskGroup *group) {
+    PoolWorker *worker =
+        current_worker != NULL && current_worker->pool == pool ? current_worker
+                                                               : NULL;
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+        Task *task = NULL;
+        if (task_depth == 0) {
+            task = take_task(pool, worker);
+        } else if (worker != NULL && (task = deque_pop(&worker->deque))) {
+            __atomic_sub_fetch(&pool->num_queued, 1, __ATOMIC_ACQ_REL);
+        }
+        if (task != NULL) {
+            run_task(pool, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0 &&
+               (task_depth > 0 ||
+                __atomic_load_n(&pool->num_queued, __ATOMIC_ACQUIRE) == 0)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
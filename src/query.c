@@ -1,47 +1,190 @@
 #include "query.h"
+#include "hash_index.h"
+#include "scan.h"
 
 ExecuteResult execute_insert(Statement *statement, Table *table) {
     Row *row_to_insert = &(statement->row_to_insert);
-    uint32_t key_to_insert = row_to_insert->id;
-    Cursor *cursor = table_find(table, key_to_insert);
+    Key key_to_insert = row_to_insert->id;
+    if (table->hash_index != NULL &&
+        hash_index_get(table->hash_index, key_to_insert) != 0) {
+        return EXECUTE_DUPLICATE_KEY;
+    }
+    Cursor *cursor = table_find_insert(table, key_to_insert);
 
     void *node = get_page(table->pager, cursor->page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
 
     if (cursor->cell_num < num_cells) {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+        Key key_at_index = *leaf_node_key(node, cursor->cell_num);
         if (key_at_index == key_to_insert) {
+            unpin_page(table->pager, cursor->page_num);
+            cursor_close(cursor);
             return EXECUTE_DUPLICATE_KEY;
         }
     }
+    unpin_page(table->pager, cursor->page_num);
 
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+    leaf_node_insert(cursor, row_to_insert);
+    table->pager->header.row_count++;
+    index_insert_row(table, row_to_insert);
 
-    free(cursor);
+    cursor_close(cursor);
 
     return EXECUTE_SUCCESS;
 }
 
+/*
+ * The positions in id order of the first row of a range and of the row
+ * after its last, each from one descent.
+ */
+static void range_positions(Statement *statement,
+                            Table *table,
+                            uint64_t *start,
+                            uint64_t *end) {
+    *start = statement->min_id == 0 ? 0 : table_rank(table, statement->min_id);
+    *end = statement->max_id == KEY_MAX
+               ? table_row_count(table)
+               : table_rank(table, statement->max_id + 1);
+}
+
+/*
+ * The rows whose username or email is a value. Their ids come from the
+ * index on the column when there is one, a descent and the leaves holding
+ * the value, or from a scan of the table split over threads. The order,
+ * offset and limit apply to the ids, and each row is then read with one
+ * lookup.
+ */
+static void select_by_value(Statement *statement, Table *table) {
+    uint64_t num_ids;
+    Key *ids = index_exists(table, statement->column)
+                   ? index_lookup(
+                         table, statement->column, statement->value, &num_ids)
+                   : table_scan_ids(table,
+                                    0,
+                                    KEY_MAX,
+                                    statement->column,
+                                    statement->value,
+                                    &num_ids);
+
+    if (statement->count) {
+        printf("(%" PRIu64 ")\n", num_ids);
+        free(ids);
+        return;
+    }
+
+    Row row;
+    for (uint64_t i = statement->offset;
+         i < num_ids && i - statement->offset < statement->limit;
+         i++) {
+        Key id = ids[statement->descending ? num_ids - 1 - i : i];
+        Cursor *cursor = table_find_row(table, id);
+        deserialize_row(cursor_value(cursor), &row);
+        print_row(&row);
+        cursor_close(cursor);
+    }
+    free(ids);
+}
+
+/*
+ * Seek to the first row of the range in the order asked for, and walk the
+ * leaves until an id past its other end or the limit, so a select reads
+ * only the leaves its rows are in. An offset or a count is found from the
+ * row counts of the internal nodes instead of by walking rows.
+ */
 ExecuteResult execute_select(Statement *statement, Table *table) {
-    Cursor *cursor = table_start(table);
+    if (statement->by_value) {
+        select_by_value(statement, table);
+        return EXECUTE_SUCCESS;
+    }
+    if (statement->min_id > statement->max_id) {
+        if (statement->count) {
+            printf("(0)\n");
+        }
+        return EXECUTE_SUCCESS;
+    }
+
+    if (statement->min_id == statement->max_id && !statement->count &&
+        statement->offset == 0 && statement->limit > 0) {
+        /* One id: a point lookup, which the hash index answers directly */
+        Cursor *cursor = table_find_row(table, statement->min_id);
+        if (cursor != NULL) {
+            Row row;
+            deserialize_row(cursor_value(cursor), &row);
+            print_row(&row);
+            cursor_close(cursor);
+        }
+        return EXECUTE_SUCCESS;
+    }
+
+    uint64_t start, end;
+    if (statement->count) {
+        range_positions(statement, table, &start, &end);
+        printf("(%" PRIu64 ")\n", end - start);
+        return EXECUTE_SUCCESS;
+    }
+
+    Cursor *cursor;
+    if (statement->offset == 0) {
+        cursor = statement->descending
+                     ? table_seek_back(table, statement->max_id)
+                     : table_seek(table, statement->min_id);
+    } else {
+        range_positions(statement, table, &start, &end);
+        if (end - start <= statement->offset) {
+            return EXECUTE_SUCCESS;
+        }
+        cursor = table_seek_position(table,
+                                     statement->descending
+                                         ? end - 1 - statement->offset
+                                         : start + statement->offset);
+    }
 
     Row row;
-    while (!(cursor->end_of_table)) {
+    uint64_t num_rows = 0;
+    while (!(cursor->end_of_table) && num_rows < statement->limit) {
         deserialize_row(cursor_value(cursor), &row);
+        if (statement->descending ? row.id < statement->min_id
+                                  : row.id > statement->max_id) {
+            break;
+        }
         print_row(&row);
-        cursor_advance(cursor);
+        num_rows++;
+        if (statement->descending) {
+            cursor_retreat(cursor);
+        } else {
+            cursor_advance(cursor);
+        }
     }
 
-    free(cursor);
+    cursor_close(cursor);
 
     return EXECUTE_SUCCESS;
 }
 
+ExecuteResult execute_create_index(Statement *statement, Table *table) {
+    if (index_exists(table, statement->column)) {
+        return EXECUTE_INDEX_EXISTS;
+    }
+    index_create(table, statement->column);
+    return EXECUTE_SUCCESS;
+}
+
 ExecuteResult execute_statement(Statement *statement, Table *table) {
+    ExecuteResult result = EXECUTE_SUCCESS;
     switch (statement->type) {
     case (STATEMENT_INSERT):
-        return execute_insert(statement, table);
+        result = execute_insert(statement, table);
+        break;
     case (STATEMENT_SELECT):
-        return execute_select(statement, table);
+        result = execute_select(statement, table);
+        break;
+    case (STATEMENT_CREATE_INDEX):
+        result = execute_create_index(statement, table);
+        break;
     }
+
+    // Each statement commits on its own
+    pager_commit(table->pager);
+
+    return result;
 }
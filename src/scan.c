@@ -0,0 +1,179 @@
+#include "scan.h"
+
+/*
+ * One part of a parallel scan: the rows with ids in [first_id, last_id],
+ * read by one pool task with its own cursor, and the ids of those that
+ * match. The task reads in the snapshot of the thread that started the scan,
+ * if any, which holds the table lock for it until the parts are done.
+ */
+typedef struct {
+    Table *table;
+    Snapshot *snapshot;
+    Key first_id;
+    Key last_id;
+    IndexColumn column;
+    const char *value;
+    Key *ids;
+    uint64_t num_ids;
+    uint64_t capacity;
+} ScanPart;
+
+static void scan_part(void *arg) {
+    ScanPart *part = arg;
+    part->capacity = 16;
+    part->ids = malloc(part->capacity * sizeof(Key));
+    part->num_ids = 0;
+    Snapshot *previous = snapshot_install(part->snapshot);
+
+    Cursor *cursor = table_seek(part->table, part->first_id);
+    Row row;
+    while (!(cursor->end_of_table)) {
+        deserialize_row(cursor_value(cursor), &row);
+        if (row.id > part->last_id) {
+            break;
+        }
+        if (strcmp(row_column_value(&row, part->column), part->value) == 0) {
+            if (part->num_ids == part->capacity) {
+                part->capacity *= 2;
+                part->ids = realloc(part->ids, part->capacity * sizeof(Key));
+            }
+            part->ids[part->num_ids++] = row.id;
+        }
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+    snapshot_install(previous);
+}
+
+static void append_keys(Key **keys,
+                        uint32_t *num_keys,
+                        uint32_t *capacity,
+                        Key key) {
+    if (*num_keys == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *keys = realloc(*keys, *capacity * sizeof(Key));
+    }
+    (*keys)[(*num_keys)++] = key;
+}
+
+/*
+ * The separator keys of the root in order, or of the root and the level
+ * below it when the root alone has fewer than wanted. Each separator ends
+ * the key range of a subtree, so they split the leaves into runs a cursor
+ * can scan without overlap. Returns a malloc'd array.
+ */
+static Key *scan_separators(Table *table, uint32_t wanted, uint32_t *num_keys) {
+    Pager *pager = table->pager;
+    uint32_t root_page_num = table->root_page_num;
+    Key *keys = NULL;
+    uint32_t capacity = 0;
+    *num_keys = 0;
+
+    latch_page(pager, root_page_num, false);
+    void *root = get_page(pager, root_page_num);
+    if (get_node_type(root) == NODE_INTERNAL) {
+        uint32_t root_keys = *internal_node_num_keys(root);
+        bool deeper = root_keys < wanted;
+        for (uint32_t i = 0; i <= root_keys; i++) {
+            uint32_t child_page_num = *internal_node_child(root, i);
+            latch_page(pager, child_page_num, false);
+            void *child = get_page(pager, child_page_num);
+            if (deeper && get_node_type(child) == NODE_INTERNAL) {
+                for (uint32_t j = 0; j < *internal_node_num_keys(child); j++) {
+                    append_keys(&keys,
+                                num_keys,
+                                &capacity,
+                                *internal_node_key(child, j));
+                }
+            }
+            unpin_page(pager, child_page_num);
+            unlatch_page(pager, child_page_num);
+            if (i < root_keys) {
+                append_keys(
+                    &keys, num_keys, &capacity, *internal_node_key(root, i));
+            }
+        }
+    }
+    unpin_page(pager, root_page_num);
+    unlatch_page(pager, root_page_num);
+    return keys;
+}
+
+/*
+ * The ids in [min_id, max_id] of the rows whose column holds value, in id
+ * order. The range is cut at separator keys into parts of about as many
+ * leaves, a few for each thread of the pool so that threads which finish
+ * early steal what is left, and each part is scanned as a task; the parts
+ * are disjoint and in order, so their ids are joined as they are. A table
+ * of one leaf, or a pool of no workers, is scanned on the calling thread.
+ * Returns a malloc'd array.
+ */
+Key *table_scan_ids(Table *table,
+                    Key min_id,
+                    Key max_id,
+                    IndexColumn column,
+                    const char *value,
+                    uint64_t *num_ids) {
+    uint32_t num_threads = pool_num_threads(table->pool);
+    uint32_t wanted = num_threads > 1 ? num_threads * SCAN_PARTS_PER_THREAD : 1;
+    uint32_t num_separators = 0;
+    Key *separators = NULL;
+    if (wanted > 1) {
+        separators = scan_separators(table, wanted, &num_separators);
+    }
+
+    /* Only separators inside the range cut it */
+    uint32_t first = 0;
+    while (first < num_separators && separators[first] < min_id) {
+        first++;
+    }
+    uint32_t num_inside = 0;
+    while (first + num_inside < num_separators &&
+           separators[first + num_inside] < max_id) {
+        num_inside++;
+    }
+
+    uint32_t num_parts = num_inside + 1 < wanted ? num_inside + 1 : wanted;
+    ScanPart *parts = calloc(num_parts, sizeof(ScanPart));
+    for (uint32_t i = 0; i < num_parts; i++) {
+        ScanPart *part = &parts[i];
+        part->table = table;
+        part->snapshot = snapshot_current();
+        part->column = column;
+        part->value = value;
+        /* Spread the cuts evenly over the separators in the range */
+        part->first_id =
+            i == 0 ? min_id
+                   : separators[first + i * (num_inside + 1) / num_parts - 1] +
+                         1;
+        part->last_id =
+            i == num_parts - 1
+                ? max_id
+                : separators[first + (i + 1) * (num_inside + 1) / num_parts - 1];
+    }
+    free(separators);
+
+    if (num_parts == 1) {
+        scan_part(&parts[0]);
+    } else {
+        TaskGroup group = {0};
+        for (uint32_t i = 0; i < num_parts; i++) {
+            pool_submit(table->pool, &group, scan_part, &parts[i]);
+        }
+        pool_wait(table->pool, &group);
+    }
+
+    *num_ids = 0;
+    for (uint32_t i = 0; i < num_parts; i++) {
+        *num_ids += parts[i].num_ids;
+    }
+    Key *ids = malloc((*num_ids ? *num_ids : 1) * sizeof(Key));
+    uint64_t num_copied = 0;
+    for (uint32_t i = 0; i < num_parts; i++) {
+        memcpy(ids + num_copied, parts[i].ids, parts[i].num_ids * sizeof(Key));
+        num_copied += parts[i].num_ids;
+        free(parts[i].ids);
+    }
+    free(parts);
+    return ids;
+}
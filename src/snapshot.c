@@ -0,0 +1,195 @@
+#include "snapshot.h"
+
+/*
+ * Snapshot reads. While reader threads run, the writer saves a copy of
+ * each page the first time it latches the page exclusively after a
+ * commit, tagged with the commit it was current at. A reader opens a
+ * snapshot at the last commit and reads, for every page, the oldest
+ * copy tagged at or after its snapshot, or the page itself if none is:
+ * the page has not changed since. So a reader never sees a statement
+ * that committed after it started, nor one half done, without holding
+ * up the writer for longer than a page latch.
+ */
+
+/*
+ * A copy of a page as it was before the writer first changed it after
+ * commit seq. Readers whose snapshot is at or before seq read it instead of
+ * the page.
+ */
+struct ShadowPage {
+    uint32_t page_num;
+    uint64_t seq;
+    struct ShadowPage *next;
+    uint8_t data[];
+};
+
+/* The snapshot the calling thread reads in, if any */
+static __thread Snapshot *thread_snapshot;
+
+static ShadowBucket *shadow_bucket(Pager *pager, uint32_t page_num) {
+    return &pager->shadow_buckets[(page_num * 2654435761u) %
+                                  PAGER_SHADOW_BUCKETS];
+}
+
+/*
+ * Read the tree as of the last commit on this thread until snapshot_end.
+ */
+void snapshot_begin(Pager *pager, Snapshot *snapshot) {
+    pthread_mutex_lock(&pager->shadow_lock);
+    snapshot->seq = pager->snapshot_seq;
+    snapshot->next = pager->snapshots;
+    pager->snapshots = snapshot;
+    pthread_mutex_unlock(&pager->shadow_lock);
+    thread_snapshot = snapshot;
+}
+
+void snapshot_end(Pager *pager, Snapshot *snapshot) {
+    thread_snapshot = NULL;
+    pthread_mutex_lock(&pager->shadow_lock);
+    Snapshot **link = &pager->snapshots;
+    while (*link != snapshot) {
+        link = &(*link)->next;
+    }
+    *link = snapshot->next;
+    pthread_mutex_unlock(&pager->shadow_lock);
+    shadow_pages_collect(pager);
+}
+
+/*
+ * The snapshot the calling thread reads in, or NULL.
+ */
+Snapshot *snapshot_current(void) {
+    return thread_snapshot;
+}
+
+/*
+ * Read in another thread's snapshot on this one, for a task it handed out
+ * and waits on, so the snapshot stays open meanwhile. Returns the snapshot
+ * this thread read in before, to install again when the task is done.
+ */
+Snapshot *snapshot_install(Snapshot *snapshot) {
+    Snapshot *previous = thread_snapshot;
+    thread_snapshot = snapshot;
+    return previous;
+}
+
+/*
+ * The copy of a page the calling thread's snapshot reads, or NULL if it
+ * reads the page itself. A reader only looks at a page it has latched or
+ * checked the version of, and the writer saves a copy before it changes
+ * either, so with no copies at all there is nothing to look up.
+ */
+void *snapshot_page(Pager *pager, uint32_t page_num) {
+    Snapshot *snapshot = thread_snapshot;
+    if (snapshot == NULL ||
+        __atomic_load_n(&pager->num_shadow_pages, __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+    }
+
+    ShadowBucket *bucket = shadow_bucket(pager, page_num);
+    pthread_mutex_lock(&bucket->lock);
+    ShadowPage *found = NULL;
+    for (ShadowPage *shadow = bucket->pages; shadow != NULL;
+         shadow = shadow->next) {
+        if (shadow->page_num == page_num && shadow->seq >= snapshot->seq &&
+            (found == NULL || shadow->seq < found->seq)) {
+            found = shadow;
+        }
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return found != NULL ? found->data : NULL;
+}
+
+/*
+ * Copy a page the writer is about to change, unless it already did since
+ * the last commit. Called with the page latched exclusively.
+ */
+void shadow_page_save(Pager *pager, uint32_t page_num, void *page) {
+    /* Only the writer commits, so the sequence cannot move under it */
+    uint64_t seq = __atomic_load_n(&pager->snapshot_seq, __ATOMIC_ACQUIRE);
+    ShadowBucket *bucket = shadow_bucket(pager, page_num);
+    pthread_mutex_lock(&bucket->lock);
+    for (ShadowPage *shadow = bucket->pages; shadow != NULL;
+         shadow = shadow->next) {
+        if (shadow->page_num == page_num && shadow->seq == seq) {
+            pthread_mutex_unlock(&bucket->lock);
+            return;
+        }
+    }
+
+    ShadowPage *shadow = malloc(sizeof(ShadowPage) + pager->page_size);
+    shadow->page_num = page_num;
+    shadow->seq = seq;
+    memcpy(shadow->data, page, pager->page_size);
+    shadow->next = bucket->pages;
+    __atomic_store_n(&bucket->pages, shadow, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&pager->num_shadow_pages, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/*
+ * Count a commit: snapshots opened from now on see it.
+ */
+void snapshot_commit(Pager *pager) {
+    pthread_mutex_lock(&pager->shadow_lock);
+    __atomic_store_n(
+        &pager->snapshot_seq, pager->snapshot_seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pager->shadow_lock);
+    shadow_pages_collect(pager);
+}
+
+/*
+ * Drop the copies no open snapshot or later one can read: those tagged
+ * before the oldest open snapshot and before the last commit. A snapshot
+ * opened while this runs is at the last commit, so it reads none of them.
+ */
+void shadow_pages_collect(Pager *pager) {
+    if (__atomic_load_n(&pager->num_shadow_pages, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pager->shadow_lock);
+    uint64_t oldest = pager->snapshot_seq;
+    for (Snapshot *snapshot = pager->snapshots; snapshot != NULL;
+         snapshot = snapshot->next) {
+        if (snapshot->seq < oldest) {
+            oldest = snapshot->seq;
+        }
+    }
+    pthread_mutex_unlock(&pager->shadow_lock);
+
+    for (uint32_t i = 0; i < PAGER_SHADOW_BUCKETS; i++) {
+        ShadowBucket *bucket = &pager->shadow_buckets[i];
+        if (__atomic_load_n(&bucket->pages, __ATOMIC_ACQUIRE) == NULL) {
+            continue;
+        }
+        uint32_t num_freed = 0;
+        pthread_mutex_lock(&bucket->lock);
+        ShadowPage **link = &bucket->pages;
+        while (*link != NULL) {
+            ShadowPage *shadow = *link;
+            if (shadow->seq < oldest) {
+                __atomic_store_n(link, shadow->next, __ATOMIC_RELAXED);
+                free(shadow);
+                num_freed++;
+            } else {
+                link = &shadow->next;
+            }
+        }
+        pthread_mutex_unlock(&bucket->lock);
+        __atomic_sub_fetch(
+            &pager->num_shadow_pages, num_freed, __ATOMIC_SEQ_CST);
+    }
+}
+
+void shadow_pages_free(Pager *pager) {
+    for (uint32_t i = 0; i < PAGER_SHADOW_BUCKETS; i++) {
+        ShadowBucket *bucket = &pager->shadow_buckets[i];
+        while (bucket->pages != NULL) {
+            ShadowPage *shadow = bucket->pages;
+            bucket->pages = shadow->next;
+            free(shadow);
+        }
+    }
+    pager->num_shadow_pages = 0;
+}
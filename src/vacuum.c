@@ -0,0 +1,271 @@
+#include "vacuum.h"
+
+/*
+ * Free pages below the target size, handed out in ascending order to the
+ * pages that have to move down from beyond it.
+ */
+typedef struct {
+    uint32_t *free_pages;
+    uint32_t next_free;
+    uint32_t target_num_pages;
+    uint32_t prev_leaf_page_num;
+} Relocation;
+
+/*
+ * Pack the leaf children of an internal node to the left: each leaf takes
+ * cells from its right sibling until the next one does not fit, and a
+ * sibling left empty is unlinked and freed. Every key and count of the node
+ * stays that of its child, and the node's own max key and row count are
+ * unchanged, so nothing above it is touched.
+ */
+static void pack_leaves(Table *table, uint32_t page_num) {
+    Pager *pager = table->pager;
+    void *node = get_page(pager, page_num);
+
+    uint32_t i = 0;
+    while (i < *internal_node_num_keys(node)) {
+        uint32_t left_page_num = *internal_node_child(node, i);
+        uint32_t right_page_num = *internal_node_child(node, i + 1);
+        void *left = get_page(pager, left_page_num);
+        void *right = get_page(pager, right_page_num);
+
+        if (get_node_type(left) != NODE_LEAF ||
+            get_node_type(right) != NODE_LEAF) {
+            unpin_page(pager, right_page_num);
+            unpin_page(pager, left_page_num);
+            i++;
+            continue;
+        }
+
+        uint32_t *left_num_cells = leaf_node_num_cells(left);
+        uint32_t *right_num_cells = leaf_node_num_cells(right);
+        uint32_t num_moved = 0;
+        while (num_moved < *right_num_cells) {
+            uint32_t size = leaf_node_cell_size(right, num_moved);
+            if (leaf_node_free_space(left) < size + LEAF_NODE_SLOT_SIZE) {
+                break;
+            }
+            memcpy(leaf_node_insert_cell(left,
+                                         *left_num_cells,
+                                         *leaf_node_key(right, num_moved),
+                                         size),
+                   leaf_node_cell(right, num_moved),
+                   size);
+            num_moved++;
+        }
+
+        if (num_moved > 0) {
+            leaf_node_remove_first_cells(right, pager->page_size, num_moved);
+            Key separator = *leaf_node_key(left, *left_num_cells - 1);
+            *internal_node_key(node, i) = separator;
+            *internal_node_count(node, i) = *left_num_cells;
+            *internal_node_count(node, i + 1) = *right_num_cells;
+            *node_high_fence(left) = separator;
+            *node_low_fence(right) = separator;
+            mark_page_dirty(pager, left_page_num);
+            mark_page_dirty(pager, right_page_num);
+            mark_page_dirty(pager, page_num);
+        }
+
+        if (*right_num_cells > 0) {
+            unpin_page(pager, right_page_num);
+            unpin_page(pager, left_page_num);
+            i++;
+            continue;
+        }
+
+        /*
+         * The right sibling is empty: drop it from the leaf chain and node,
+         * and widen the left leaf's range to cover it
+         */
+        uint32_t next_page_num = *leaf_node_next_leaf(right);
+        *leaf_node_next_leaf(left) = next_page_num;
+        if (next_page_num != 0) {
+            void *next = get_page(pager, next_page_num);
+            *leaf_node_prev_leaf(next) = left_page_num;
+            mark_page_dirty(pager, next_page_num);
+            unpin_page(pager, next_page_num);
+        }
+        *node_high_fence(left) = *node_high_fence(right);
+        *node_fence_flags(left) =
+            (*node_fence_flags(left) & NODE_HAS_LOW_FENCE) |
+            (*node_fence_flags(right) & NODE_HAS_HIGH_FENCE);
+        uint32_t num_keys = *internal_node_num_keys(node);
+        if (i + 1 == num_keys) {
+            *internal_node_right_child(node) = left_page_num;
+        } else {
+            memmove(internal_node_key(node, i),
+                    internal_node_key(node, i + 1),
+                    (num_keys - i - 1) * INTERNAL_NODE_KEY_SIZE);
+            memmove(internal_node_child_slot(node, i + 1),
+                    internal_node_child_slot(node, i + 2),
+                    (num_keys - i - 2) * INTERNAL_NODE_CHILD_SIZE);
+            memmove(internal_node_count(node, i + 1),
+                    internal_node_count(node, i + 2),
+                    (num_keys - i - 1) * INTERNAL_NODE_COUNT_SIZE);
+        }
+        *internal_node_num_keys(node) = num_keys - 1;
+        mark_page_dirty(pager, left_page_num);
+        mark_page_dirty(pager, page_num);
+        unpin_page(pager, right_page_num);
+        unpin_page(pager, left_page_num);
+        free_page(pager, right_page_num);
+    }
+
+    unpin_page(pager, page_num);
+}
+
+/*
+ * Pack leaves bottom up. Each internal node is committed on its own, so a
+ * large tree never has to hold all of its changes in the buffer pool.
+ */
+static void compact_node(Table *table, uint32_t page_num) {
+    void *node = get_page(table->pager, page_num);
+    if (get_node_type(node) == NODE_LEAF) {
+        unpin_page(table->pager, page_num);
+        return;
+    }
+
+    for (uint32_t i = 0; i <= *internal_node_num_keys(node); i++) {
+        compact_node(table, *internal_node_child(node, i));
+    }
+    unpin_page(table->pager, page_num);
+
+    pack_leaves(table, page_num);
+    pager_commit(table->pager);
+}
+
+/*
+ * An internal root left with a single child is replaced by that child, copied
+ * into the root page so the root keeps its page number.
+ */
+static void collapse_root(Table *table) {
+    Pager *pager = table->pager;
+    uint32_t root_page_num = table->root_page_num;
+    void *root = get_page(pager, root_page_num);
+
+    while (get_node_type(root) == NODE_INTERNAL &&
+           *internal_node_num_keys(root) == 0) {
+        uint32_t child_page_num = *internal_node_right_child(root);
+        void *child = get_page(pager, child_page_num);
+
+        memcpy(root, child, pager->page_size);
+        set_node_root(root, true);
+        mark_page_dirty(pager, root_page_num);
+        unpin_page(pager, child_page_num);
+        free_page(pager, child_page_num);
+    }
+
+    unpin_page(pager, root_page_num);
+}
+
+/*
+ * Walk the subtree in key order and move every page at or beyond the target
+ * size into a free slot below it. The parent is repointed at the new page. The
+ * leaf chain is relinked both ways as the leaves are visited, so it stays in
+ * key order.
+ */
+static void relocate_node(Table *table,
+                          Relocation *relocation,
+                          uint32_t page_num) {
+    Pager *pager = table->pager;
+    void *node = get_page(pager, page_num);
+
+    if (get_node_type(node) == NODE_LEAF) {
+        uint32_t prev_page_num = relocation->prev_leaf_page_num;
+        if (prev_page_num != INVALID_PAGE_NUM) {
+            void *prev = get_page(pager, prev_page_num);
+            if (*leaf_node_next_leaf(prev) != page_num) {
+                *leaf_node_next_leaf(prev) = page_num;
+                mark_page_dirty(pager, prev_page_num);
+            }
+            unpin_page(pager, prev_page_num);
+        } else {
+            prev_page_num = 0;
+        }
+        if (*leaf_node_prev_leaf(node) != prev_page_num) {
+            *leaf_node_prev_leaf(node) = prev_page_num;
+            mark_page_dirty(pager, page_num);
+        }
+        relocation->prev_leaf_page_num = page_num;
+        unpin_page(pager, page_num);
+        return;
+    }
+
+    for (uint32_t i = 0; i <= *internal_node_num_keys(node); i++) {
+        uint32_t *child_pointer = internal_node_child(node, i);
+        uint32_t child_page_num = *child_pointer;
+
+        if (child_page_num >= relocation->target_num_pages) {
+            uint32_t new_page_num =
+                relocation->free_pages[relocation->next_free++];
+            void *old_child = get_page(pager, child_page_num);
+            void *new_child = get_page(pager, new_page_num);
+            memcpy(new_child, old_child, pager->page_size);
+            mark_page_dirty(pager, new_page_num);
+            unpin_page(pager, new_page_num);
+            unpin_page(pager, child_page_num);
+
+            *child_pointer = new_page_num;
+            mark_page_dirty(pager, page_num);
+            child_page_num = new_page_num;
+        }
+
+        relocate_node(table, relocation, child_page_num);
+    }
+
+    unpin_page(pager, page_num);
+}
+
+static int compare_page_nums(const void *a, const void *b) {
+    uint32_t page_a = *(const uint32_t *)a;
+    uint32_t page_b = *(const uint32_t *)b;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+/*
+ * Compact the database file: pack leaves so empty ones can be freed, move the
+ * pages in use at the end of the file into free slots nearer the start, and
+ * truncate what is left over. Indexes are dropped first and built again on
+ * the compacted table, so only the table's pages have to be moved.
+ */
+void table_vacuum(Table *table) {
+    Pager *pager = table->pager;
+
+    bool indexed[NUM_INDEX_COLUMNS];
+    for (uint32_t column = 0; column < NUM_INDEX_COLUMNS; column++) {
+        indexed[column] = index_exists(table, column);
+        if (indexed[column]) {
+            index_drop(table, column);
+        }
+    }
+
+    compact_node(table, table->root_page_num);
+    collapse_root(table);
+    pager_commit(pager);
+
+    uint32_t num_free;
+    uint32_t *free_pages = pager_drain_freelist(pager, &num_free);
+    qsort(free_pages, num_free, sizeof(uint32_t), compare_page_nums);
+
+    Relocation relocation;
+    relocation.free_pages = free_pages;
+    relocation.next_free = 0;
+    relocation.target_num_pages = pager->num_pages - num_free;
+    relocation.prev_leaf_page_num = INVALID_PAGE_NUM;
+    relocate_node(table, &relocation, table->root_page_num);
+
+    pager_truncate(pager, relocation.target_num_pages);
+    free(free_pages);
+    table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+    if (table->hash_index != NULL) {
+        hash_index_build(table);
+    }
+
+    for (uint32_t column = 0; column < NUM_INDEX_COLUMNS; column++) {
+        if (indexed[column]) {
+            index_create(table, column);
+        }
+    }
+    pager_commit(pager);
+}
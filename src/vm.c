@@ -7,11 +7,38 @@ meta_command_result do_meta_command(InputBuffer *input_buffer, Table *table) {
         exit(EXIT_SUCCESS);
     } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
         printf("Tree:\n");
-        print_tree(table->pager, 0, 0);
+        print_tree(table->pager, table->root_page_num, 0);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".dbinfo") == 0) {
+        printf("Header:\n");
+        print_header(table);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".vacuum") == 0) {
+        /* Vacuum moves pages without latching them */
+        pthread_rwlock_wrlock(&table->lock);
+        table_vacuum(table);
+        pthread_rwlock_unlock(&table->lock);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".load") == 0 ||
+               strncmp(input_buffer->buffer, ".load ", 6) == 0) {
+        strtok(input_buffer->buffer, " ");
+        char *filename = strtok(NULL, " ");
+        char *fill_string = strtok(NULL, " ");
+        uint32_t fill_percent =
+            fill_string ? atoi(fill_string) : LOAD_DEFAULT_FILL_PERCENT;
+        if (filename == NULL || fill_percent < LOAD_MIN_FILL_PERCENT ||
+            fill_percent > 100) {
+            printf("Usage: .load <file> [fill percent %d-100]\n",
+                   LOAD_MIN_FILL_PERCENT);
+            return META_COMMAND_SUCCESS;
+        }
+        pthread_rwlock_wrlock(&table->lock);
+        table_bulk_load(table, filename, fill_percent);
+        pthread_rwlock_unlock(&table->lock);
         return META_COMMAND_SUCCESS;
     } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
         printf("Constants:\n");
-        print_constants();
+        print_constants(table);
         return META_COMMAND_SUCCESS;
     } else {
         return META_COMMAND_UNRECOGNIZED_COMMAND;
@@ -27,13 +54,45 @@ prepare_result prepare_insert(InputBuffer *input_buffer,
     char *username = strtok(NULL, " ");
     char *email = strtok(NULL, " ");
 
+    return parse_row(id_string, username, email, &statement->row_to_insert);
+}
+
+prepare_result parse_id(char *id_string, Key *id) {
+    if (id_string == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (id_string[0] == '-') {
+        return PREPARE_NEGATIVE_ID;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(id_string, &end, 10);
+    if (end == id_string || *end != '\0') {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (errno == ERANGE || value > KEY_MAX) {
+        return PREPARE_ID_TOO_LARGE;
+    }
+
+    *id = value;
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * Check and copy the fields of a row given as text, as in an insert
+ * statement or a line of a load file.
+ */
+prepare_result parse_row(char *id_string, char *username, char *email,
+                         Row *row) {
     if (id_string == NULL || username == NULL || email == NULL) {
         return PREPARE_SYNTAX_ERROR;
     }
 
-    int id = atoi(id_string);
-    if (id < 0) {
-        return PREPARE_NEGATIVE_ID;
+    Key id;
+    prepare_result result = parse_id(id_string, &id);
+    if (result != PREPARE_SUCCESS) {
+        return result;
     }
     if (strlen(username) > COLUMN_USERNAME_SIZE) {
         return PREPARE_STRING_TOO_LONG;
@@ -42,10 +101,181 @@ prepare_result prepare_insert(InputBuffer *input_buffer,
         return PREPARE_STRING_TOO_LONG;
     }
 
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
+    row->id = id;
+    strcpy(row->username, username);
+    strcpy(row->email, email);
+
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * The condition after where: id (= | < | <= | > | >=) <id>, or
+ * id between <a> and <b>. Every form becomes an inclusive range of ids. A
+ * range that can hold no id is stored as min_id > max_id. Or
+ * (username | email) = <value>.
+ */
+static prepare_result prepare_where(Statement *statement) {
+    char *column = strtok(NULL, " ");
+    char *op = strtok(NULL, " ");
+    if (column == NULL || op == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (index_column_from_name(column, &statement->column)) {
+        char *value = strtok(NULL, " ");
+        if (strcmp(op, "=") != 0 || value == NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        uint32_t max_length = statement->column == INDEX_USERNAME
+                                  ? COLUMN_USERNAME_SIZE
+                                  : COLUMN_EMAIL_SIZE;
+        if (strlen(value) > max_length) {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        strcpy(statement->value, value);
+        statement->by_value = true;
+        return PREPARE_SUCCESS;
+    }
+    if (strcmp(column, "id") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    Key id;
+    prepare_result result = parse_id(strtok(NULL, " "), &id);
+    if (result != PREPARE_SUCCESS) {
+        return result;
+    }
+
+    if (strcmp(op, "=") == 0) {
+        statement->min_id = id;
+        statement->max_id = id;
+    } else if (strcmp(op, ">=") == 0) {
+        statement->min_id = id;
+    } else if (strcmp(op, "<=") == 0) {
+        statement->max_id = id;
+    } else if (strcmp(op, ">") == 0 && id < KEY_MAX) {
+        statement->min_id = id + 1;
+    } else if (strcmp(op, "<") == 0 && id > 0) {
+        statement->max_id = id - 1;
+    } else if (strcmp(op, ">") == 0 || strcmp(op, "<") == 0) {
+        /* Nothing is above KEY_MAX or below 0 */
+        statement->min_id = 1;
+        statement->max_id = 0;
+    } else if (strcmp(op, "between") == 0) {
+        char *and = strtok(NULL, " ");
+        if (and == NULL || strcmp(and, "and") != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->min_id = id;
+        result = parse_id(strtok(NULL, " "), &statement->max_id);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * A number of rows, as after limit or offset.
+ */
+static prepare_result parse_row_count(char *string, uint64_t *count) {
+    if (string == NULL || string[0] == '-') {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    char *end;
+    errno = 0;
+    *count = strtoull(string, &end, 10);
+    if (end == string || *end != '\0' || errno == ERANGE) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * select [count] [where <condition>] [order by id [asc | desc]]
+ *        [limit <n>] [offset <n>]
+ */
+prepare_result prepare_select(InputBuffer *input_buffer,
+                              Statement *statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->min_id = 0;
+    statement->max_id = KEY_MAX;
+    statement->descending = false;
+    statement->limit = UINT64_MAX;
+    statement->offset = 0;
+    statement->count = false;
+    statement->by_value = false;
+
+    strtok(input_buffer->buffer, " ");
+    char *token = strtok(NULL, " ");
+
+    if (token != NULL && strcmp(token, "count") == 0) {
+        statement->count = true;
+        token = strtok(NULL, " ");
+    }
+
+    if (token != NULL && strcmp(token, "where") == 0) {
+        prepare_result result = prepare_where(statement);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+        token = strtok(NULL, " ");
+    }
+
+    if (token != NULL && strcmp(token, "order") == 0) {
+        char *by = strtok(NULL, " ");
+        char *column = strtok(NULL, " ");
+        if (by == NULL || strcmp(by, "by") != 0 || column == NULL ||
+            strcmp(column, "id") != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        token = strtok(NULL, " ");
+        if (token != NULL && strcmp(token, "desc") == 0) {
+            statement->descending = true;
+            token = strtok(NULL, " ");
+        } else if (token != NULL && strcmp(token, "asc") == 0) {
+            token = strtok(NULL, " ");
+        }
+    }
+
+    if (token != NULL && strcmp(token, "limit") == 0) {
+        if (parse_row_count(strtok(NULL, " "), &statement->limit) !=
+            PREPARE_SUCCESS) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        token = strtok(NULL, " ");
+    }
+
+    if (token != NULL && strcmp(token, "offset") == 0) {
+        if (parse_row_count(strtok(NULL, " "), &statement->offset) !=
+            PREPARE_SUCCESS) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        token = strtok(NULL, " ");
+    }
+
+    return token == NULL ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+/*
+ * create index on (username | email)
+ */
+prepare_result prepare_create_index(InputBuffer *input_buffer,
+                                    Statement *statement) {
+    statement->type = STATEMENT_CREATE_INDEX;
 
+    strtok(input_buffer->buffer, " ");
+    char *index = strtok(NULL, " ");
+    char *on = strtok(NULL, " ");
+    char *column = strtok(NULL, " ");
+    if (index == NULL || strcmp(index, "index") != 0 || on == NULL ||
+        strcmp(on, "on") != 0 || column == NULL ||
+        !index_column_from_name(column, &statement->column) ||
+        strtok(NULL, " ") != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
     return PREPARE_SUCCESS;
 }
 
@@ -54,9 +284,12 @@ prepare_result prepare_statement(InputBuffer *input_buffer,
     if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
         return prepare_insert(input_buffer, statement);
     }
-    if (strcmp(input_buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+    if (strcmp(input_buffer->buffer, "select") == 0 ||
+        strncmp(input_buffer->buffer, "select ", 7) == 0) {
+        return prepare_select(input_buffer, statement);
+    }
+    if (strncmp(input_buffer->buffer, "create ", 7) == 0) {
+        return prepare_create_index(input_buffer, statement);
     }
 
     return PREPARE_UNRECOGNIZED_STATEMENT;
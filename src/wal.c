@@ -0,0 +1,307 @@
+#include "wal.h"
+
+static char *wal_path(const char *db_filename, const char *suffix) {
+    size_t length = strlen(db_filename);
+    size_t suffix_length = strlen(suffix);
+    char *path = malloc(length + suffix_length + 1);
+    memcpy(path, db_filename, length);
+    memcpy(path + length, suffix, suffix_length + 1);
+    return path;
+}
+
+static uint64_t wal_checksum_seed(uint32_t salt) {
+    return ((uint64_t)salt << 32) | salt;
+}
+
+/*
+ * Seeding each frame's checksum with the checksum of the previous frame means
+ * a frame only validates if every frame before it did, so a torn write cuts
+ * the log off cleanly.
+ */
+static uint64_t wal_frame_checksum(uint64_t seed,
+                                   void *header,
+                                   void *page,
+                                   uint32_t page_size) {
+    uint64_t checksum =
+        fletcher_checksum(seed, header, WAL_FRAME_CHECKSUM_OFFSET);
+    return fletcher_checksum(checksum, page, page_size);
+}
+
+/*
+ * Append iovcnt buffers at the end of the log, looping over short writes.
+ */
+static void wal_write(Wal *wal, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t bytes_written =
+            pwritev(wal->file_descriptor, iov, iovcnt, wal->file_length);
+
+        if (bytes_written == -1) {
+            printf("Error writing WAL: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+
+        wal->file_length += bytes_written;
+        while (iovcnt > 0 && (size_t)bytes_written >= iov->iov_len) {
+            bytes_written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base += bytes_written;
+            iov->iov_len -= bytes_written;
+        }
+    }
+}
+
+static void wal_write_header(Wal *wal) {
+    uint8_t header[WAL_HEADER_SIZE];
+    memset(header, 0, WAL_HEADER_SIZE);
+    *(uint32_t *)(header + WAL_MAGIC_OFFSET) = WAL_MAGIC;
+    *(uint32_t *)(header + WAL_VERSION_OFFSET) = WAL_VERSION;
+    *(uint32_t *)(header + WAL_PAGE_SIZE_OFFSET) = wal->page_size;
+    *(uint32_t *)(header + WAL_SALT_OFFSET) = wal->salt;
+
+    struct iovec iov = {.iov_base = header, .iov_len = WAL_HEADER_SIZE};
+    wal->file_length = 0;
+    wal_write(wal, &iov, 1);
+
+    wal->checksum = wal_checksum_seed(wal->salt);
+    wal->num_frames = 0;
+}
+
+/*
+ * Copy the committed page images of one log into the database file. Frames
+ * up to the last valid commit frame are applied; a trailing statement that
+ * never committed is discarded. The page size comes from the log header, so
+ * recovery does not depend on reading the database header first.
+ */
+static void wal_replay(const char *path, int db_fd) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    uint8_t header[WAL_HEADER_SIZE];
+    uint32_t page_size = 0;
+    bool valid = pread(fd, header, WAL_HEADER_SIZE, 0) == WAL_HEADER_SIZE &&
+                 *(uint32_t *)(header + WAL_MAGIC_OFFSET) == WAL_MAGIC &&
+                 *(uint32_t *)(header + WAL_VERSION_OFFSET) == WAL_VERSION;
+    if (valid) {
+        page_size = *(uint32_t *)(header + WAL_PAGE_SIZE_OFFSET);
+        valid = page_size >= PAGER_MIN_PAGE_SIZE &&
+                page_size <= PAGER_MAX_PAGE_SIZE;
+    }
+
+    if (valid) {
+        uint32_t salt = *(uint32_t *)(header + WAL_SALT_OFFSET);
+        uint32_t frame_size = WAL_FRAME_HEADER_SIZE + page_size;
+        void *frame = malloc(frame_size);
+
+        /* First pass: find the end of the last committed statement */
+        uint64_t checksum = wal_checksum_seed(salt);
+        uint64_t offset = WAL_HEADER_SIZE;
+        uint64_t commit_end = WAL_HEADER_SIZE;
+        while (pread(fd, frame, frame_size, offset) == frame_size) {
+            if (*(uint32_t *)(frame + WAL_FRAME_SALT_OFFSET) != salt) {
+                break;
+            }
+            checksum = wal_frame_checksum(
+                checksum, frame, frame + WAL_FRAME_HEADER_SIZE, page_size);
+            if (*(uint64_t *)(frame + WAL_FRAME_CHECKSUM_OFFSET) != checksum) {
+                break;
+            }
+            offset += frame_size;
+            if (*(uint32_t *)(frame + WAL_FRAME_DB_PAGES_OFFSET) != 0) {
+                commit_end = offset;
+            }
+        }
+
+        /* Second pass: copy the committed page images into place */
+        for (offset = WAL_HEADER_SIZE; offset < commit_end;
+             offset += frame_size) {
+            if (pread(fd, frame, frame_size, offset) != frame_size) {
+                printf("Error reading WAL: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            uint32_t page_num = *(uint32_t *)(frame + WAL_FRAME_PAGE_NUM_OFFSET);
+            ssize_t bytes_written = pwrite(db_fd,
+                                           frame + WAL_FRAME_HEADER_SIZE,
+                                           page_size,
+                                           (off_t)page_num * page_size);
+            if (bytes_written != (ssize_t)page_size) {
+                printf("Error writing: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (commit_end > WAL_HEADER_SIZE && fdatasync(db_fd) == -1) {
+            printf("Error syncing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        free(frame);
+    }
+
+    close(fd);
+    unlink(path);
+}
+
+/*
+ * Replay the logs left behind by a session that did not close cleanly. A log
+ * retired by an unfinished checkpoint holds older statements than the live
+ * one, so it goes first.
+ */
+void wal_recover(const char *db_filename, int db_fd) {
+    char *old_path = wal_path(db_filename, "-wal-old");
+    char *path = wal_path(db_filename, "-wal");
+    wal_replay(old_path, db_fd);
+    wal_replay(path, db_fd);
+    free(old_path);
+    free(path);
+}
+
+Wal *wal_open(const char *db_filename,
+              uint32_t group_commits,
+              uint32_t page_size) {
+    Wal *wal = malloc(sizeof(Wal));
+    wal->page_size = page_size;
+    wal->path = wal_path(db_filename, "-wal");
+    wal->old_path = wal_path(db_filename, "-wal-old");
+    wal->file_descriptor =
+        open(wal->path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+
+    if (wal->file_descriptor == -1) {
+        printf("Unable to open WAL file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    wal->salt = now_usec() ^ getpid();
+    wal->commit_seq = 0;
+    wal->synced_seq = 0;
+    wal->group_commits = group_commits > 0 ? group_commits : 1;
+    wal->first_pending_usec = 0;
+    wal_write_header(wal);
+
+    return wal;
+}
+
+/*
+ * Log one committed statement. Its pages go out in a single vectored write
+ * with the last frame marked as the commit. The write is not synced here;
+ * see wal_sync_due. Returns the sequence number of the commit.
+ */
+uint64_t wal_commit(Wal *wal,
+                uint32_t num_pages,
+                const uint32_t *page_nums,
+                void *const *pages,
+                uint32_t db_num_pages) {
+    uint8_t *headers = calloc(num_pages, WAL_FRAME_HEADER_SIZE);
+    struct iovec iov[IOV_MAX];
+    int iovcnt = 0;
+
+    for (uint32_t i = 0; i < num_pages; i++) {
+        void *header = headers + i * WAL_FRAME_HEADER_SIZE;
+        *(uint32_t *)(header + WAL_FRAME_PAGE_NUM_OFFSET) = page_nums[i];
+        *(uint32_t *)(header + WAL_FRAME_DB_PAGES_OFFSET) =
+            i == num_pages - 1 ? db_num_pages : 0;
+        *(uint32_t *)(header + WAL_FRAME_SALT_OFFSET) = wal->salt;
+        wal->checksum =
+            wal_frame_checksum(wal->checksum, header, pages[i], wal->page_size);
+        *(uint64_t *)(header + WAL_FRAME_CHECKSUM_OFFSET) = wal->checksum;
+
+        iov[iovcnt].iov_base = header;
+        iov[iovcnt].iov_len = WAL_FRAME_HEADER_SIZE;
+        iov[iovcnt + 1].iov_base = pages[i];
+        iov[iovcnt + 1].iov_len = wal->page_size;
+        iovcnt += 2;
+        if (iovcnt + 2 > IOV_MAX) {
+            wal_write(wal, iov, iovcnt);
+            iovcnt = 0;
+        }
+    }
+    wal_write(wal, iov, iovcnt);
+    free(headers);
+
+    wal->num_frames += num_pages;
+    if (wal->synced_seq == wal->commit_seq) {
+        wal->first_pending_usec = now_usec();
+    }
+    return ++wal->commit_seq;
+}
+
+/*
+ * Commits are made durable in groups: once group_commits statements have
+ * accumulated or the oldest of them has waited WAL_GROUP_COMMIT_USEC, so many
+ * commits share one fdatasync.
+ */
+bool wal_sync_due(Wal *wal) {
+    uint64_t pending = wal->commit_seq - wal->synced_seq;
+    return pending >= wal->group_commits ||
+           (pending > 0 &&
+            now_usec() - wal->first_pending_usec >= WAL_GROUP_COMMIT_USEC);
+}
+
+void wal_sync(Wal *wal) {
+    if (wal->synced_seq == wal->commit_seq) {
+        return;
+    }
+    if (fdatasync(wal->file_descriptor) == -1) {
+        printf("Error syncing WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    wal->synced_seq = wal->commit_seq;
+}
+
+bool wal_needs_checkpoint(Wal *wal) {
+    return wal->num_frames >= WAL_CHECKPOINT_FRAMES;
+}
+
+/*
+ * Start the log over once a checkpoint has made every logged page durable in
+ * the database file. A fresh salt keeps any stale frames from validating.
+ */
+void wal_reset(Wal *wal) {
+    if (ftruncate(wal->file_descriptor, 0) == -1) {
+        printf("Error truncating WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    unlink(wal->old_path);
+    wal->salt++;
+    wal_write_header(wal);
+}
+
+/*
+ * Retire the current log so a checkpoint can copy its pages into the database
+ * file while new commits go to a fresh log. The log must be fully synced. The
+ * retired log stays on disk until wal_retire_done, so a crash in between still
+ * replays it.
+ */
+void wal_retire(Wal *wal) {
+    if (rename(wal->path, wal->old_path) == -1) {
+        printf("Error renaming WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    close(wal->file_descriptor);
+    wal->file_descriptor =
+        open(wal->path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+
+    if (wal->file_descriptor == -1) {
+        printf("Unable to open WAL file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    wal->salt++;
+    wal_write_header(wal);
+}
+
+void wal_retire_done(Wal *wal) {
+    unlink(wal->old_path);
+}
+
+void wal_close(Wal *wal) {
+    close(wal->file_descriptor);
+    unlink(wal->path);
+    unlink(wal->old_path);
+    free(wal->path);
+    free(wal->old_path);
+    free(wal);
+}
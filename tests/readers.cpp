@@ -0,0 +1,389 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+
+extern "C" {
+#include "db.h"
+#include "cursor.h"
+#include "query.h"
+#include "scan.h"
+}
+
+using namespace std;
+
+/*
+ * Threads that read the tree while the test inserts rows, in a database
+ * opened for concurrent readers. Each one runs random seeks, scans, lookups
+ * and ranks and checks what it reads: ids in order, the row it asked for,
+ * every id the table had when they started, and row counts that agree with
+ * the rows a scan finds.
+ */
+class ReaderChecker {
+public:
+    static const uint32_t SCAN_ROWS = 16;
+    static const uint32_t KNOWN_KEYS = 256;
+
+    atomic<uint64_t> reads{0};
+    atomic<uint64_t> errors{0};
+
+    ReaderChecker(Table *table, uint32_t num_threads) : table(table) {
+        sample_keys();
+        for (uint32_t i = 0; i < num_threads; i++) {
+            threads.emplace_back(&ReaderChecker::run, this, i);
+        }
+    }
+
+    ~ReaderChecker() { stop_threads(); }
+
+    void stop_threads() {
+        stop = true;
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+    // Wait until the readers finish a few more reads
+    void wait_for_reads(uint64_t count) {
+        uint64_t target = reads + count;
+        while (reads < target) {
+            this_thread::yield();
+        }
+    }
+
+private:
+    Table *table;
+    vector<thread> threads;
+    atomic<bool> stop{false};
+    vector<Key> known_keys;
+    // Random keys are drawn below key_limit, a little past the last id
+    uint64_t key_limit = 1;
+
+    void sample_keys() {
+        uint64_t num_rows = table_row_count(table);
+        uint64_t num_keys = num_rows < KNOWN_KEYS ? num_rows : KNOWN_KEYS;
+        Row row;
+        for (uint64_t i = 0; i < num_keys; i++) {
+            Cursor *cursor =
+                table_seek_position(table, num_rows * i / num_keys);
+            deserialize_row(cursor_value(cursor), &row);
+            cursor_close(cursor);
+            known_keys.push_back(row.id);
+        }
+
+        uint64_t max_id = 0;
+        Cursor *cursor = table_seek_back(table, KEY_MAX);
+        if (!cursor->end_of_table) {
+            deserialize_row(cursor_value(cursor), &row);
+            max_id = row.id;
+        }
+        cursor_close(cursor);
+        key_limit = max_id < KEY_MAX - KEY_MAX / 8 - 2 ? max_id + max_id / 8 + 2
+                                                       : KEY_MAX;
+    }
+
+    bool scan(Key key, bool backward) {
+        Cursor *cursor =
+            backward ? table_seek_back(table, key) : table_seek(table, key);
+        bool ok = true;
+        Key prev_id = key;
+        Row row;
+        for (uint32_t i = 0; i < SCAN_ROWS && !cursor->end_of_table; i++) {
+            deserialize_row(cursor_value(cursor), &row);
+            if (i == 0) {
+                ok &= backward ? row.id <= key : row.id >= key;
+            } else {
+                ok &= backward ? row.id < prev_id : row.id > prev_id;
+            }
+            prev_id = row.id;
+            if (backward) {
+                cursor_retreat(cursor);
+            } else {
+                cursor_advance(cursor);
+            }
+        }
+        cursor_close(cursor);
+        return ok;
+    }
+
+    bool lookup(Key key, bool must_exist) {
+        Cursor *cursor = table_find_row(table, key);
+        if (cursor == NULL) {
+            return !must_exist;
+        }
+        Row row;
+        deserialize_row(cursor_value(cursor), &row);
+        cursor_close(cursor);
+        return row.id == key &&
+               string(row.username) == "user" + to_string(key);
+    }
+
+    // The ranks of the ends of a scan, from the counts in the internal
+    // nodes, are as many rows apart as it found
+    bool count(Key key) {
+        Cursor *cursor = table_seek(table, key);
+        uint64_t num_rows = 0;
+        Row row;
+        while (num_rows < SCAN_ROWS && !cursor->end_of_table) {
+            deserialize_row(cursor_value(cursor), &row);
+            num_rows++;
+            cursor_advance(cursor);
+        }
+        cursor_close(cursor);
+
+        uint64_t start = table_rank(table, key);
+        uint64_t end = num_rows > 0 ? table_rank(table, row.id) + 1 : start;
+        return end - start == num_rows;
+    }
+
+    bool step(uint64_t random) {
+        Key key = (random >> 8) % key_limit;
+        switch (random % 6) {
+        case 0:
+            return scan(key, false);
+        case 1:
+            return scan(key, true);
+        case 2:
+            return lookup(key, false);
+        case 3:
+            return known_keys.empty() ||
+                   lookup(known_keys[(random >> 8) % known_keys.size()], true);
+        case 4:
+            return count(key);
+        default:
+            // Rows are only added, so a later count is at least the rank
+            return table_rank(table, key) <= table_row_count(table);
+        }
+    }
+
+    void run(uint32_t index) {
+        uint64_t random = 0x9E3779B97F4A7C15ULL * (index + 1);
+        Snapshot snapshot;
+        while (!stop) {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            db_read_begin(table, &snapshot);
+            bool ok = step(random);
+            db_read_end(table, &snapshot);
+            errors += !ok;
+            reads++;
+        }
+    }
+};
+
+class ReadersTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        remove("readers.db");
+        remove("readers.db-wal");
+        remove("readers.db-wal-old");
+    }
+
+    void TearDown() override {
+        remove("readers.db");
+        remove("readers.db-wal");
+        remove("readers.db-wal-old");
+    }
+
+    Table *open(DbOptions options) {
+        options.concurrent_readers = true;
+        return db_open("readers.db", &options);
+    }
+
+    ExecuteResult insert(Table *table, Key id, string username = "") {
+        Statement statement = {};
+        statement.type = STATEMENT_INSERT;
+        statement.row_to_insert.id = id;
+        if (username.empty()) {
+            username = "user" + to_string(id);
+        }
+        snprintf(statement.row_to_insert.username,
+                 sizeof(statement.row_to_insert.username),
+                 "%s",
+                 username.c_str());
+        snprintf(statement.row_to_insert.email,
+                 sizeof(statement.row_to_insert.email),
+                 "person%s@example.com",
+                 to_string(id).c_str());
+        return execute_statement(&statement, table);
+    }
+
+    /*
+     * Point lookups of rows already inserted find them, while sequential
+     * then random inserts split internal nodes under the readers. Without
+     * snapshots the readers see every page as the writer changes it.
+     */
+    void lookups_follow_splits(bool snapshots) {
+        // Durability is not at stake, so commits don't wait for each sync
+        DbOptions options = db_default_options();
+        options.async_commit = true;
+        Table *table = open(options);
+        const Key num_sequential = 12000;
+        const Key num_random = 12000;
+        vector<Key> ids;
+        for (Key i = 1; i <= num_sequential; i++) {
+            ids.push_back(i);
+        }
+        for (Key i = 1; i <= num_random; i++) {
+            ids.push_back(num_sequential + (i * 7919 % 1000003) * 4);
+        }
+
+        atomic<size_t> num_inserted{0};
+        atomic<bool> stop{false};
+        atomic<uint64_t> reads{0};
+        atomic<uint64_t> errors{0};
+        auto run = [&](uint64_t random) {
+            Snapshot snapshot;
+            while (!stop) {
+                random ^= random << 13;
+                random ^= random >> 7;
+                random ^= random << 17;
+                size_t count = num_inserted;
+                if (count == 0) {
+                    continue;
+                }
+                Key id = ids[random % count];
+                if (snapshots) {
+                    db_read_begin(table, &snapshot);
+                }
+                Cursor *cursor = table_find_row(table, id);
+                bool ok = cursor != NULL;
+                if (ok) {
+                    Row row;
+                    deserialize_row(cursor_value(cursor), &row);
+                    cursor_close(cursor);
+                    ok = row.id == id &&
+                         string(row.username) == "user" + to_string(id);
+                }
+                if (snapshots) {
+                    db_read_end(table, &snapshot);
+                }
+                errors += !ok;
+                reads++;
+            }
+        };
+        vector<thread> threads;
+        for (uint64_t i = 1; i <= 4; i++) {
+            threads.emplace_back(run, 0x9E3779B97F4A7C15ULL * i);
+        }
+
+        for (size_t i = 0; i < ids.size(); i++) {
+            ASSERT_EQ(insert(table, ids[i]), EXECUTE_SUCCESS);
+            num_inserted = i + 1;
+        }
+        stop = true;
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        EXPECT_GT(reads, 0);
+        EXPECT_EQ(errors, 0);
+        EXPECT_EQ(table_row_count(table), ids.size());
+        db_close(table);
+    }
+};
+
+TEST_F(ReadersTest, ReadersRunWhileRowsAreInserted) {
+    // Reader threads scan and look up rows while inserts split the tree
+    DbOptions options = db_default_options();
+    options.hash_index = true;
+    Table *table = open(options);
+    for (Key i = 1; i < 300; i++) {
+        ASSERT_EQ(insert(table, i * 37 % 1301), EXECUTE_SUCCESS);
+    }
+
+    ReaderChecker checker(table, 4);
+    checker.wait_for_reads(1);
+    uint64_t reads_before = checker.reads;
+    for (Key i = 300; i <= 1300; i++) {
+        ASSERT_EQ(insert(table, i * 37 % 1301), EXECUTE_SUCCESS);
+        if (i % 100 == 0) {
+            checker.wait_for_reads(10);
+        }
+    }
+    uint64_t reads_during = checker.reads - reads_before;
+    checker.stop_threads();
+
+    EXPECT_GT(reads_during, 0);
+    EXPECT_EQ(checker.errors, 0);
+    EXPECT_EQ(table_row_count(table), 1300);
+    db_close(table);
+}
+
+TEST_F(ReadersTest, ReadersShareASmallBufferPool) {
+    // More readers than frames wait for pins to come free, not exit
+    DbOptions options = db_default_options();
+    options.cache_pages = 16;
+    options.async_commit = true;
+    Table *table = open(options);
+    for (Key i = 1; i <= 3000; i++) {
+        ASSERT_EQ(insert(table, i), EXECUTE_SUCCESS);
+    }
+
+    ReaderChecker checker(table, 64);
+    for (Key i = 3001; i <= 4000; i++) {
+        ASSERT_EQ(insert(table, i * 7919 % 100000 + 3001), EXECUTE_SUCCESS);
+        if (i % 100 == 0) {
+            checker.wait_for_reads(10);
+        }
+    }
+    checker.stop_threads();
+
+    EXPECT_GT(checker.reads, 0);
+    EXPECT_EQ(checker.errors, 0);
+    EXPECT_EQ(table_row_count(table), 4000);
+    db_close(table);
+}
+
+TEST_F(ReadersTest, LookupsFollowInternalNodeSplits) {
+    lookups_follow_splits(true);
+}
+
+TEST_F(ReadersTest, UnlatchedDescentsFollowInternalNodeSplits) {
+    // Readers outside a snapshot meet half done splits on the live pages
+    lookups_follow_splits(false);
+}
+
+TEST_F(ReadersTest, ParallelScansReadTheCallersSnapshot) {
+    // The parts of a scan run on pool workers, which must see the rows as
+    // of the snapshot the scan started in, not rows inserted since between
+    // them
+    DbOptions options = db_default_options();
+    options.threads = 4;
+    options.async_commit = true;
+    Table *table = open(options);
+    const Key num_rows = 3000;
+    for (Key i = 1; i <= num_rows; i++) {
+        ASSERT_EQ(insert(table, i * 2, "same"), EXECUTE_SUCCESS);
+    }
+
+    Snapshot snapshot;
+    db_read_begin(table, &snapshot);
+    thread writer([&] {
+        for (Key i = 0; i < num_rows; i++) {
+            ASSERT_EQ(insert(table, i * 2 + 1, "same"), EXECUTE_SUCCESS);
+        }
+    });
+    writer.join();
+    uint64_t num_errors = 0;
+    for (int scan = 0; scan < 10; scan++) {
+        uint64_t num_ids = 0;
+        Key *ids = table_scan_ids(
+            table, 0, KEY_MAX, INDEX_USERNAME, "same", &num_ids);
+        bool same = num_ids == num_rows;
+        for (uint64_t i = 0; same && i < num_ids; i++) {
+            same = ids[i] == (i + 1) * 2;
+        }
+        num_errors += !same;
+        free(ids);
+    }
+    db_read_end(table, &snapshot);
+
+    EXPECT_EQ(num_errors, 0);
+    EXPECT_EQ(table_row_count(table), 2 * num_rows);
+    db_close(table);
+}
@@ -4,9 +4,11 @@
 #include <cstring>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <vector>
 #include <string>
+#include <algorithm>
 
 using namespace std;
 
@@ -14,13 +16,20 @@ class DatabaseTest : public ::testing::Test {
 protected:
     void SetUp() override {
         remove("test.db");
+        remove("test.db-wal");
+        remove("test.db-wal-old");
+        remove("test.load");
     }
 
     void TearDown() override {
         remove("test.db");
+        remove("test.db-wal");
+        remove("test.db-wal-old");
+        remove("test.load");
     }
 
-    vector<string> run_script(const vector<string> &commands) {
+    vector<string> run_script(const vector<string> &commands,
+                              const vector<string> &args = {}) {
         int stdin_pipe[2], stdout_pipe[2];
         pid_t pid;
 
@@ -46,8 +55,14 @@ protected:
             close(stdin_pipe[0]);
             close(stdout_pipe[1]);
 
-            execl("build/db", "db", "test.db", nullptr);
-            perror("execl");
+            vector<char *> argv = {(char *)"db", (char *)"test.db"};
+            for (const auto &arg : args) {
+                argv.push_back((char *)arg.c_str());
+            }
+            argv.push_back(nullptr);
+
+            execv("build/db", argv.data());
+            perror("execv");
             exit(EXIT_FAILURE);
         } else { // Parent process
             close(stdin_pipe[0]);
@@ -162,6 +177,24 @@ TEST_F(DatabaseTest, TooLongStrings) {
     EXPECT_EQ(output[2], "db > ");
 }
 
+TEST_F(DatabaseTest, LargestKey) {
+    vector<string> script = {"insert 4294967295 user1 person1@example.com",
+                             "insert 4294967296 user2 person2@example.com",
+                             "select",
+                             ".exit"};
+
+    auto output = run_script(script);
+
+    vector<string> expected = {
+        "db > Executed.",
+        "db > ID is too large.",
+        "db > (4294967295, user1, person1@example.com)",
+        "Executed.",
+        "db > ",
+    };
+    EXPECT_EQ(output, expected);
+}
+
 TEST_F(DatabaseTest, NegativeId) {
     vector<string> script = {"insert -1 cstack foo@bar.com", "select", ".exit"};
 
@@ -210,6 +243,246 @@ TEST_F(DatabaseTest, BtreeOneNode) {
     EXPECT_EQ(output[8], "db > ");
 }
 
+TEST_F(DatabaseTest, InternalNodeSplit) {
+    vector<string> expected;
+    const int num_rows = 8000;
+    const int batch_rows = 2000;
+    // Long emails keep the rows per leaf low, so the tree needs many leaves
+    const string email_prefix(200, 'e');
+    for (int batch = 0; batch < num_rows / batch_rows; batch++) {
+        vector<string> script;
+        for (int i = batch * batch_rows + 1; i <= (batch + 1) * batch_rows;
+             i++) {
+            // Scattered order, so splits happen all over the tree
+            int id = (long)i * 7919 % (num_rows + 1);
+            script.push_back("insert " + to_string(id) + " user" +
+                             to_string(id) + " " + email_prefix +
+                             to_string(id) + "@example.com");
+        }
+        script.push_back(".exit");
+        run_script(script);
+    }
+    for (int i = 1; i <= num_rows; i++) {
+        expected.push_back("(" + to_string(i) + ", user" + to_string(i) +
+                           ", " + email_prefix + to_string(i) +
+                           "@example.com)");
+    }
+
+    auto output = run_script({"select", ".btree", ".exit"});
+
+    ASSERT_GE(output.size(), num_rows + 3);
+    vector<string> rows(output.begin(), output.begin() + num_rows);
+    rows[0] = rows[0].substr(string("db > ").size());
+    EXPECT_EQ(rows, expected);
+
+    // The root has split: three levels, with the leaves at the bottom
+    EXPECT_EQ(output[num_rows + 1], "db > Tree:");
+    EXPECT_EQ(output[num_rows + 2], "- internal (size 2)");
+    int internal_nodes = 0;
+    for (size_t i = num_rows + 2; i < output.size(); i++) {
+        if (output[i].find("- internal") != string::npos) {
+            internal_nodes++;
+            EXPECT_TRUE(output[i].rfind("- internal", 0) == 0 ||
+                        output[i].rfind("  - internal", 0) == 0);
+        }
+    }
+    EXPECT_EQ(internal_nodes, 4);
+}
+
+TEST_F(DatabaseTest, AppendsFillLeaves) {
+    vector<string> script;
+    for (int i = 1; i <= 1500; i++) {
+        script.push_back("insert " + to_string(i) + " user" + to_string(i) +
+                         " person" + to_string(i) + "@example.com");
+    }
+    script.push_back(".exit");
+    run_script(script);
+
+    auto output = run_script({".btree", ".exit"});
+
+    // Ids in increasing order leave every leaf but the last one full
+    vector<int> leaf_sizes;
+    for (const auto &line : output) {
+        size_t pos = line.find("- leaf (size ");
+        if (pos != string::npos) {
+            leaf_sizes.push_back(
+                atoi(line.c_str() + pos + string("- leaf (size ").size()));
+        }
+    }
+    ASSERT_GE(leaf_sizes.size(), 2);
+    for (size_t i = 0; i + 1 < leaf_sizes.size(); i++) {
+        EXPECT_GE(leaf_sizes[i], 90);
+    }
+    EXPECT_LE(leaf_sizes.size(), 16);
+}
+
+TEST_F(DatabaseTest, SelectById) {
+    vector<string> script;
+    for (int i = 1; i <= 1000; i++) {
+        script.push_back("insert " + to_string(i) + " user" + to_string(i) +
+                         " person" + to_string(i) + "@example.com");
+    }
+    script.push_back(".exit");
+    run_script(script);
+
+    auto output = run_script({"select where id = 500",
+                              "select where id between 299 and 301",
+                              "select where id > 998",
+                              "select where id < 2",
+                              "select where id = 1001",
+                              "select where id between 5 and 4",
+                              "select where id = x",
+                              ".exit"});
+
+    vector<string> expected = {
+        "db > (500, user500, person500@example.com)",
+        "Executed.",
+        "db > (299, user299, person299@example.com)",
+        "(300, user300, person300@example.com)",
+        "(301, user301, person301@example.com)",
+        "Executed.",
+        "db > (999, user999, person999@example.com)",
+        "(1000, user1000, person1000@example.com)",
+        "Executed.",
+        "db > (1, user1, person1@example.com)",
+        "Executed.",
+        "db > Executed.",
+        "db > Executed.",
+        "db > Syntax error. Could not parse statement.",
+        "db > ",
+    };
+    EXPECT_EQ(output, expected);
+}
+
+TEST_F(DatabaseTest, SelectDescending) {
+    vector<string> script;
+    for (int i = 1; i <= 1000; i++) {
+        // Scattered order, so leaves split all over the chain
+        int id = i * 37 % 1001;
+        script.push_back("insert " + to_string(id) + " user" + to_string(id) +
+                         " person" + to_string(id) + "@example.com");
+    }
+    script.push_back(".exit");
+    run_script(script);
+
+    auto output = run_script({"select order by id desc limit 3",
+                              "select where id < 300 order by id desc limit 2",
+                              "select where id between 5 and 7 order by id desc",
+                              ".exit"});
+
+    vector<string> expected = {
+        "db > (1000, user1000, person1000@example.com)",
+        "(999, user999, person999@example.com)",
+        "(998, user998, person998@example.com)",
+        "Executed.",
+        "db > (299, user299, person299@example.com)",
+        "(298, user298, person298@example.com)",
+        "Executed.",
+        "db > (7, user7, person7@example.com)",
+        "(6, user6, person6@example.com)",
+        "(5, user5, person5@example.com)",
+        "Executed.",
+        "db > ",
+    };
+    EXPECT_EQ(output, expected);
+
+    // Walking back through every leaf gives the forward order reversed
+    auto forward = run_script({"select", ".exit"});
+    auto backward = run_script({"select order by id desc", ".exit"});
+    ASSERT_EQ(forward.size(), 1002);
+    ASSERT_EQ(backward.size(), 1002);
+    forward[0] = forward[0].substr(string("db > ").size());
+    backward[0] = backward[0].substr(string("db > ").size());
+    forward.resize(1000);
+    backward.resize(1000);
+    reverse(backward.begin(), backward.end());
+    EXPECT_EQ(backward, forward);
+}
+
+TEST_F(DatabaseTest, CountAndOffset) {
+    vector<string> script;
+    for (int i = 1; i <= 1000; i++) {
+        // Scattered order, so the counts go through many splits
+        int id = i * 37 % 1001;
+        script.push_back("insert " + to_string(id * 2) + " user" +
+                         to_string(id * 2) + " person" + to_string(id * 2) +
+                         "@example.com");
+    }
+    script.push_back(".exit");
+    run_script(script);
+
+    auto output = run_script({"select count",
+                              "select count where id between 100 and 199",
+                              "select count where id < 501",
+                              "select limit 2 offset 700",
+                              "select order by id desc limit 1 offset 10",
+                              "select where id > 1000 limit 1 offset 5",
+                              "select limit 1 offset 1000",
+                              ".exit"});
+
+    vector<string> expected = {
+        "db > (1000)",
+        "Executed.",
+        "db > (50)",
+        "Executed.",
+        "db > (250)",
+        "Executed.",
+        "db > (1402, user1402, person1402@example.com)",
+        "(1404, user1404, person1404@example.com)",
+        "Executed.",
+        "db > (1980, user1980, person1980@example.com)",
+        "Executed.",
+        "db > (1012, user1012, person1012@example.com)",
+        "Executed.",
+        "db > Executed.",
+        "db > ",
+    };
+    EXPECT_EQ(output, expected);
+}
+
+TEST_F(DatabaseTest, SecondaryIndex) {
+    // Half the rows exist when the index is created, half are added after
+    vector<string> script;
+    for (int i = 1; i <= 1000; i++) {
+        if (i == 501) {
+            script.push_back("create index on username");
+            script.push_back("create index on email");
+        }
+        script.push_back("insert " + to_string(i) + " group" +
+                         to_string(i % 10) + " person" + to_string(i) +
+                         "@example.com");
+    }
+    script.push_back(".exit");
+    run_script(script);
+
+    auto output = run_script({"select where email = person777@example.com",
+                              "select count where username = group3",
+                              "select where username = group3 limit 2",
+                              "select where username = group3 order by id "
+                              "desc limit 1",
+                              "select where email = nobody@example.com",
+                              "create index on email",
+                              "create index on id",
+                              ".exit"});
+
+    vector<string> expected = {
+        "db > (777, group7, person777@example.com)",
+        "Executed.",
+        "db > (100)",
+        "Executed.",
+        "db > (3, group3, person3@example.com)",
+        "(13, group3, person13@example.com)",
+        "Executed.",
+        "db > (993, group3, person993@example.com)",
+        "Executed.",
+        "db > Executed.",
+        "db > Error: Index already exists.",
+        "db > Syntax error. Could not parse statement.",
+        "db > ",
+    };
+    EXPECT_EQ(output, expected);
+}
+
 TEST_F(DatabaseTest, PrintConstants) {
     vector<string> script = {".constants", ".exit"};
     auto output = run_script(script);
@@ -217,14 +490,343 @@ TEST_F(DatabaseTest, PrintConstants) {
     ASSERT_GE(output.size(), 8);
     EXPECT_EQ(output[0], "db > Constants:");
     EXPECT_EQ(output[1], "ROW_SIZE: 293");
-    EXPECT_EQ(output[2], "COMMON_NODE_HEADER_SIZE: 6");
-    EXPECT_EQ(output[3], "LEAF_NODE_HEADER_SIZE: 14");
-    EXPECT_EQ(output[4], "LEAF_NODE_CELL_SIZE: 297");
-    EXPECT_EQ(output[5], "LEAF_NODE_SPACE_FOR_CELLS: 4082");
-    EXPECT_EQ(output[6], "LEAF_NODE_MAX_CELLS: 13");
+    EXPECT_EQ(output[2], "COMMON_NODE_HEADER_SIZE: 11");
+    EXPECT_EQ(output[3], "LEAF_NODE_HEADER_SIZE: 27");
+    EXPECT_EQ(output[4], "LEAF_NODE_SLOT_SIZE: 6");
+    EXPECT_EQ(output[5], "LEAF_NODE_SPACE_FOR_CELLS: 4069");
+    EXPECT_EQ(output[6], "INTERNAL_NODE_MAX_KEYS: 339");
     EXPECT_EQ(output[7], "db > ");
 }
 
+TEST_F(DatabaseTest, SmallBufferPool) {
+    vector<string> script;
+    vector<string> expected;
+    for (int i = 1; i <= 1000; i++) {
+        string row = to_string(i) + " user" + to_string(i) + " person" +
+                     to_string(i) + "@example.com";
+        script.push_back("insert " + row);
+        expected.push_back("(" + to_string(i) + ", user" + to_string(i) +
+                           ", person" + to_string(i) + "@example.com)");
+    }
+    script.push_back(".exit");
+
+    // 1000 rows span far more pages than the 16 frames in the pool
+    auto output = run_script(script, {"--cache-pages", "16"});
+    ASSERT_EQ(output.size(), 1001);
+    EXPECT_EQ(output[999], "db > Executed.");
+
+    output = run_script({"select", ".exit"}, {"--cache-pages", "16"});
+    ASSERT_EQ(output.size(), 1002);
+    EXPECT_EQ(output[0], "db > " + expected[0]);
+    for (int i = 1; i < 1000; i++) {
+        EXPECT_EQ(output[i], expected[i]);
+    }
+    EXPECT_EQ(output[1000], "Executed.");
+}
+
+TEST_F(DatabaseTest, BackgroundFlusher) {
+    vector<string> script;
+    for (int i = 1; i <= 1500; i++) {
+        script.push_back("insert " + to_string(i) + " user" + to_string(i) +
+                         " person" + to_string(i) + "@example.com");
+    }
+    script.push_back(".exit");
+
+    // A fast flusher on a small pool writes pages and checkpoints the log
+    // while statements are still coming in
+    vector<string> args = {"--cache-pages", "16", "--flush-rate", "100000"};
+    auto output = run_script(script, args);
+    ASSERT_EQ(output.size(), 1501);
+    EXPECT_EQ(output[1499], "db > Executed.");
+
+    struct stat st;
+    EXPECT_NE(stat("test.db-wal", &st), 0);
+    EXPECT_NE(stat("test.db-wal-old", &st), 0);
+
+    output = run_script({"select", ".exit"}, args);
+    ASSERT_EQ(output.size(), 1502);
+    EXPECT_EQ(output[0], "db > (1, user1, person1@example.com)");
+    for (int i = 2; i <= 1500; i++) {
+        EXPECT_EQ(output[i - 1], "(" + to_string(i) + ", user" + to_string(i) +
+                                     ", person" + to_string(i) +
+                                     "@example.com)");
+    }
+    EXPECT_EQ(output[1500], "Executed.");
+}
+
+TEST_F(DatabaseTest, VacuumShrinksFile) {
+    vector<string> script;
+    vector<string> expected;
+    for (int i = 1; i <= 1500; i++) {
+        // Insert in a scattered order so leaves end up partly full
+        int id = i * 37 % 1501;
+        script.push_back("insert " + to_string(id) + " user" + to_string(id) +
+                         " person" + to_string(id) + "@example.com");
+        expected.push_back("(" + to_string(i) + ", user" + to_string(i) +
+                           ", person" + to_string(i) + "@example.com)");
+    }
+    script.push_back(".exit");
+    run_script(script);
+
+    struct stat before, after;
+    ASSERT_EQ(stat("test.db", &before), 0);
+    run_script({".vacuum", ".exit"});
+    ASSERT_EQ(stat("test.db", &after), 0);
+    EXPECT_LT(after.st_size, before.st_size);
+    EXPECT_EQ(after.st_size % 4096, 0);
+
+    auto output = run_script({"select", ".exit"});
+    ASSERT_EQ(output.size(), 1502);
+    output[0] = output[0].substr(string("db > ").size());
+    output.resize(1500);
+    EXPECT_EQ(output, expected);
+}
+
+TEST_F(DatabaseTest, HeaderPersistsMetadata) {
+    run_script({"insert 1 user1 person1@example.com",
+                "insert 2 user2 person2@example.com",
+                "insert 2 user2 person2@example.com",
+                "insert 3 user3 person3@example.com",
+                ".exit"});
+
+    auto output = run_script({".dbinfo", ".exit"});
+    vector<string> expected = {
+        "db > Header:",
+        "format version: 10",
+        "page size: 4096",
+        "key bits: 32",
+        "pages: 2",
+        "root page: 1",
+        "free pages: 0",
+        "rows: 3",
+        "db > ",
+    };
+    EXPECT_EQ(output, expected);
+}
+
+TEST_F(DatabaseTest, PageSizeChosenAtCreation) {
+    vector<string> script;
+    for (int i = 1; i <= 200; i++) {
+        script.push_back("insert " + to_string(i) + " user" + to_string(i) +
+                         " person" + to_string(i) + "@example.com");
+    }
+    script.push_back(".constants");
+    script.push_back(".exit");
+    auto output = run_script(script, {"--page-size", "16384"});
+
+    ASSERT_GE(output.size(), 207);
+    EXPECT_EQ(output[205], "LEAF_NODE_SPACE_FOR_CELLS: 16357");
+    EXPECT_EQ(output[206], "INTERNAL_NODE_MAX_KEYS: 1363");
+
+    // Reopening without the flag keeps the page size from the header
+    output = run_script({".dbinfo", "select", ".exit"});
+    ASSERT_GE(output.size(), 208);
+    EXPECT_EQ(output[2], "page size: 16384");
+    EXPECT_EQ(output[7], "rows: 200");
+    EXPECT_EQ(output[8], "db > (1, user1, person1@example.com)");
+    EXPECT_EQ(output[207], "(200, user200, person200@example.com)");
+}
+
+TEST_F(DatabaseTest, RejectsInvalidPageSize) {
+    auto output = run_script({".exit"}, {"--page-size", "5000"});
+    vector<string> expected = {
+        "Page size must be a power of two from 4096 to 65536."};
+    EXPECT_EQ(output, expected);
+}
+
+TEST_F(DatabaseTest, RejectsFileWithoutHeader) {
+    // A file from before the header page starts with a root node
+    FILE *file = fopen("test.db", "w");
+    char page[4096] = {1, 1};
+    fwrite(page, sizeof(page), 1, file);
+    fclose(file);
+
+    auto output = run_script({"select", ".exit"});
+    vector<string> expected = {"File is not a database or has no header."};
+    EXPECT_EQ(output, expected);
+}
+
+TEST_F(DatabaseTest, MmapPager) {
+    vector<string> script1 = {"insert 1 user1 person1@example.com",
+                              "insert 2 user2 person2@example.com",
+                              ".exit"};
+    auto output1 = run_script(script1, {"--mmap"});
+
+    ASSERT_GE(output1.size(), 3);
+    EXPECT_EQ(output1[0], "db > Executed.");
+    EXPECT_EQ(output1[1], "db > Executed.");
+
+    // Pages written through the mapping are readable by the buffered pager
+    auto output2 = run_script({"select", ".exit"});
+
+    ASSERT_GE(output2.size(), 4);
+    EXPECT_EQ(output2[0], "db > (1, user1, person1@example.com)");
+    EXPECT_EQ(output2[1], "(2, user2, person2@example.com)");
+    EXPECT_EQ(output2[2], "Executed.");
+    EXPECT_EQ(output2[3], "db > ");
+}
+
+TEST_F(DatabaseTest, HashIndexPointLookups) {
+    // Scattered ids split leaves while the index is kept up to date
+    vector<string> script;
+    for (int i = 1; i <= 1000; i++) {
+        int id = i * 37 % 1001;
+        script.push_back("insert " + to_string(id) + " user" + to_string(id) +
+                         " person" + to_string(id) + "@example.com");
+    }
+    script.push_back("select where id = 296");
+    script.push_back(".exit");
+    auto output1 = run_script(script, {"--hash-index"});
+
+    ASSERT_GE(output1.size(), 3);
+    EXPECT_EQ(output1[output1.size() - 3],
+              "db > (296, user296, person296@example.com)");
+
+    // Built again from the leaves when the database is opened
+    auto output2 = run_script({"select where id = 1000",
+                               "select where id = 1001",
+                               "insert 7 user7 person7@example.com",
+                               ".exit"},
+                              {"--hash-index"});
+
+    vector<string> expected = {
+        "db > (1000, user1000, person1000@example.com)",
+        "Executed.",
+        "db > Executed.",
+        "db > Error: Duplicate key.",
+        "db > ",
+    };
+    EXPECT_EQ(output2, expected);
+}
+
+TEST_F(DatabaseTest, ScanSplitOverThreads) {
+    // Without an index the leaves are scanned in parts, one per thread
+    vector<string> script;
+    for (int i = 1; i <= 400; i++) {
+        int id = i * 37 % 401;
+        script.push_back("insert " + to_string(id) + " user" +
+                         to_string(id % 7) + " person" + to_string(id) +
+                         "@example.com");
+    }
+    script.push_back("select count where username = user3");
+    script.push_back("select where username = user3 limit 2");
+    script.push_back(
+        "select where username = user3 order by id desc limit 1");
+    script.push_back(".exit");
+    auto output = run_script(script, {"--threads", "4"});
+
+    ASSERT_GE(output.size(), 8);
+    vector<string> tail(output.end() - 8, output.end());
+    vector<string> expected = {
+        "db > (57)",
+        "Executed.",
+        "db > (3, user3, person3@example.com)",
+        "(10, user3, person10@example.com)",
+        "Executed.",
+        "db > (395, user3, person395@example.com)",
+        "Executed.",
+        "db > ",
+    };
+    EXPECT_EQ(tail, expected);
+}
+
+TEST_F(DatabaseTest, ReadOnlySessionDoesNotWrite) {
+    run_script({"insert 1 user1 person1@example.com", ".exit"});
+
+    struct stat before, after;
+    ASSERT_EQ(stat("test.db", &before), 0);
+
+    auto output = run_script({"select", ".btree", ".exit"});
+    ASSERT_GE(output.size(), 2);
+    EXPECT_EQ(output[0], "db > (1, user1, person1@example.com)");
+
+    // Only dirty pages are written back, so the file is left untouched
+    ASSERT_EQ(stat("test.db", &after), 0);
+    EXPECT_EQ(before.st_mtim.tv_sec, after.st_mtim.tv_sec);
+    EXPECT_EQ(before.st_mtim.tv_nsec, after.st_mtim.tv_nsec);
+}
+
+TEST_F(DatabaseTest, BulkLoadSortedFile) {
+    const int num_rows = 12000;
+    const string email_prefix(200, 'e');
+    vector<string> expected;
+    FILE *file = fopen("test.load", "w");
+    ASSERT_NE(file, nullptr);
+    for (int i = 1; i <= num_rows; i++) {
+        string row = to_string(i) + " user" + to_string(i) + " " +
+                     email_prefix + to_string(i) + "@example.com";
+        fprintf(file, "%s\n", row.c_str());
+        expected.push_back("(" + to_string(i) + ", user" + to_string(i) +
+                           ", " + email_prefix + to_string(i) +
+                           "@example.com)");
+    }
+    fclose(file);
+
+    auto load_output = run_script({".load test.load", ".exit"});
+    ASSERT_GE(load_output.size(), 1);
+    EXPECT_EQ(load_output[0], "db > Loaded 12000 rows.");
+
+    auto output = run_script({"select", ".btree", ".exit"});
+    ASSERT_GE(output.size(), num_rows + 3);
+    vector<string> rows(output.begin(), output.begin() + num_rows);
+    rows[0] = rows[0].substr(string("db > ").size());
+    EXPECT_EQ(rows, expected);
+
+    // Too many leaves for one internal node: three levels
+    EXPECT_EQ(output[num_rows + 1], "db > Tree:");
+    EXPECT_EQ(output[num_rows + 2].rfind("- internal", 0), 0);
+    EXPECT_EQ(output[num_rows + 3].rfind("  - internal", 0), 0);
+
+    // The loaded tree takes ordinary inserts
+    auto insert_output = run_script(
+        {"insert 0 user0 person0@example.com",
+         "insert 6000 user6000 person6000@example.com",
+         "insert 12001 user12001 person12001@example.com", ".dbinfo",
+         ".exit"});
+    ASSERT_GE(insert_output.size(), 11);
+    EXPECT_EQ(insert_output[0], "db > Executed.");
+    EXPECT_EQ(insert_output[1], "db > Error: Duplicate key.");
+    EXPECT_EQ(insert_output[2], "db > Executed.");
+    EXPECT_EQ(insert_output[10], "rows: 12002");
+}
+
+TEST_F(DatabaseTest, BulkLoadRejectsUnsortedFile) {
+    FILE *file = fopen("test.load", "w");
+    ASSERT_NE(file, nullptr);
+    fprintf(file, "1 user1 person1@example.com\n");
+    fprintf(file, "3 user3 person3@example.com\n");
+    fprintf(file, "2 user2 person2@example.com\n");
+    fclose(file);
+
+    auto output = run_script({".load test.load", "select", ".exit"});
+    ASSERT_GE(output.size(), 2);
+    EXPECT_EQ(output[0],
+              "db > Rows must be sorted by id with no duplicates (line 3).");
+    EXPECT_EQ(output[1], "db > Executed.");
+}
+
+TEST_F(DatabaseTest, RecoverFromWal) {
+    // No .exit, so the process dies on end of input without closing the db
+    vector<string> script1 = {"insert 1 user1 person1@example.com",
+                              "insert 2 user2 person2@example.com"};
+    auto output1 = run_script(script1);
+
+    ASSERT_GE(output1.size(), 3);
+    EXPECT_EQ(output1[0], "db > Executed.");
+    EXPECT_EQ(output1[1], "db > Executed.");
+    EXPECT_EQ(output1[2], "db > Error reading input");
+    EXPECT_EQ(access("test.db-wal", F_OK), 0);
+
+    auto output2 = run_script({"select", ".exit"});
+
+    ASSERT_GE(output2.size(), 4);
+    EXPECT_EQ(output2[0], "db > (1, user1, person1@example.com)");
+    EXPECT_EQ(output2[1], "(2, user2, person2@example.com)");
+    EXPECT_EQ(output2[2], "Executed.");
+    EXPECT_EQ(output2[3], "db > ");
+    EXPECT_NE(access("test.db-wal", F_OK), 0);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,84 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <string>
+
+extern "C" {
+#include "db.h"
+#include "query.h"
+#include "wal.h"
+}
+
+using namespace std;
+
+class WalTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        remove("wal.db");
+        remove("wal.db-wal");
+        remove("wal.db-wal-old");
+    }
+
+    void TearDown() override {
+        remove("wal.db");
+        remove("wal.db-wal");
+        remove("wal.db-wal-old");
+    }
+
+    ExecuteResult insert(Table *table, Key id) {
+        Statement statement = {};
+        statement.type = STATEMENT_INSERT;
+        statement.row_to_insert.id = id;
+        snprintf(statement.row_to_insert.username,
+                 sizeof(statement.row_to_insert.username),
+                 "user%s",
+                 to_string(id).c_str());
+        snprintf(statement.row_to_insert.email,
+                 sizeof(statement.row_to_insert.email),
+                 "person%s@example.com",
+                 to_string(id).c_str());
+        return execute_statement(&statement, table);
+    }
+
+    bool synced(Pager *pager) {
+        pthread_mutex_lock(&pager->lock);
+        bool synced = pager->wal->synced_seq == pager->wal->commit_seq;
+        pthread_mutex_unlock(&pager->lock);
+        return synced;
+    }
+};
+
+TEST_F(WalTest, GroupCommitSyncsWithoutFlushRate) {
+    // A group that never fills is synced after the deadline, with the
+    // prompt idle and no pages being flushed
+    DbOptions options = db_default_options();
+    options.flush_rate = 0;
+    options.wal_group_commits = 32;
+    options.async_commit = true;
+    Table *table = db_open("wal.db", &options);
+    for (Key i = 1; i <= 3; i++) {
+        ASSERT_EQ(insert(table, i), EXECUTE_SUCCESS);
+    }
+
+    bool done = false;
+    for (int i = 0; i < 100 && !done; i++) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+        done = synced(table->pager);
+    }
+    EXPECT_TRUE(done);
+    db_close(table);
+}
+
+TEST_F(WalTest, StatementReturnsAfterItsCommitIsSynced) {
+    // Without async_commit an insert is durable once it returns, though it
+    // is far from filling a group
+    DbOptions options = db_default_options();
+    options.wal_group_commits = 32;
+    Table *table = db_open("wal.db", &options);
+    for (Key i = 1; i <= 3; i++) {
+        ASSERT_EQ(insert(table, i), EXECUTE_SUCCESS);
+        EXPECT_TRUE(synced(table->pager));
+    }
+    db_close(table);
+}